@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+
+# Copyright 2012 ShareBrained Technology, Inc.
+#
+# This file is part of readerboard.
+#
+# readerboard is free software: you can redistribute
+# it and/or modify it under the terms of the GNU General
+# Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your
+# option) any later version.
+#
+# readerboard is distributed in the hope that it will
+# be useful, but WITHOUT ANY WARRANTY; without even the
+# implied warranty of MERCHANTABILITY or FITNESS FOR A
+# PARTICULAR PURPOSE. See the GNU General Public License
+# for more details.
+#
+# You should have received a copy of the GNU General
+# Public License along with readerboard. If not, see
+# <http://www.gnu.org/licenses/>.
+
+# Converts a BDF font to a C header for the firmware:
+#
+#   python bdf2font.py <name> <font.bdf> > <font.h>
+#
+# The glyphs are packed side by side into one bitmap, the "strike": 7 rows,
+# MSB first, each glyph starting at the bit where the one before it ends.
+# blit() takes a source bit offset, so a glyph is drawn straight out of the
+# strike. A glyph table gives each glyph's bit offset, width and advance.
+# Encodings must be consecutive.
+
+import sys
+
+cell_height = 7
+
+def fail(message):
+    sys.stderr.write("bdf2font: %s\n" % message)
+    sys.exit(1)
+
+def read_bdf(f):
+    ascent = None
+    glyphs = {}
+    glyph = None
+    bitmap = None
+    for line in f:
+        fields = line.split()
+        if not fields:
+            continue
+        keyword = fields[0]
+        if bitmap is not None:
+            if keyword == 'ENDCHAR':
+                glyph['bitmap'] = bitmap
+                glyphs[glyph['encoding']] = glyph
+                glyph, bitmap = None, None
+            else:
+                bitmap.append(int(keyword, 16) << (8 * (4 - len(keyword) // 2)))
+        elif keyword == 'FONT_ASCENT':
+            ascent = int(fields[1])
+        elif keyword == 'STARTCHAR':
+            glyph = {'name': fields[1]}
+        elif keyword == 'ENCODING':
+            glyph['encoding'] = int(fields[1])
+        elif keyword == 'DWIDTH':
+            glyph['advance'] = int(fields[1])
+        elif keyword == 'BBX':
+            glyph['bbx'] = [int(x) for x in fields[1:5]]
+        elif keyword == 'BITMAP':
+            bitmap = []
+    if ascent is None:
+        fail("no FONT_ASCENT")
+    return ascent, glyphs
+
+def glyph_rows(glyph, ascent):
+    # Rows of the glyph's cell as (width, [row bits, MSB = leftmost]).
+    w, h, x_offset, y_offset = glyph['bbx']
+    x_offset = max(x_offset, 0)
+    width = x_offset + w if w else 0
+    if width > 8:
+        fail("%s: wider than 8 pixels" % glyph['name'])
+    top = ascent - (y_offset + h)
+    if h and ((top < 0) or (top + h > cell_height)):
+        fail("%s: does not fit %d rows" % (glyph['name'], cell_height))
+    rows = [0] * cell_height
+    for i, bits in enumerate(glyph['bitmap'][:h]):
+        # Bitmap rows are left-aligned in 32 bits here.
+        row = (bits >> (32 - w)) if w else 0
+        rows[top + i] = row << (width - w)
+    return width, rows
+
+def main():
+    if len(sys.argv) != 3:
+        fail("usage: bdf2font.py <name> <font.bdf>")
+    name, path = sys.argv[1], sys.argv[2]
+    ascent, glyphs = read_bdf(open(path))
+
+    codes = sorted(glyphs)
+    first = codes[0]
+    if codes != list(range(first, first + len(codes))):
+        fail("encodings are not consecutive")
+
+    table = []
+    strike = [0] * cell_height
+    offset = 0
+    for code in codes:
+        width, rows = glyph_rows(glyphs[code], ascent)
+        for y in range(cell_height):
+            strike[y] = (strike[y] << width) | rows[y]
+        table.append((offset, width, glyphs[code]['advance'], code))
+        offset += width
+    if offset > 0xFFFF:
+        fail("strike wider than 65535 pixels")
+
+    strike_bytes = (offset + 7) // 8
+    pad = strike_bytes * 8 - offset
+
+    out = []
+    out.append("/* Generated by bdf2font.py from %s. Do not edit. */" % path)
+    out.append("")
+    out.append("static const uint8_t %s_first = %d;" % (name, first))
+    out.append("static const uint8_t %s_count = %d;" % (name, len(codes)))
+    out.append("static const uint8_t %s_strike_width_bytes = %d;" % (name, strike_bytes))
+    out.append("")
+    out.append("PROGMEM const uint8_t %s_strike[%d][%d] = {" % (name, cell_height, strike_bytes))
+    for y in range(cell_height):
+        row = strike[y] << pad
+        data = [(row >> (8 * (strike_bytes - 1 - i))) & 0xFF for i in range(strike_bytes)]
+        for i in range(0, strike_bytes, 12):
+            prefix = "\t{ " if i == 0 else "\t  "
+            suffix = " }," if i + 12 >= strike_bytes else ","
+            out.append(prefix + ", ".join("0x%02X" % b for b in data[i:i + 12]) + suffix)
+    out.append("};")
+    out.append("")
+    out.append("PROGMEM const font_glyph_t %s_glyph[%d] = {" % (name, len(codes)))
+    for offset, width, advance, code in table:
+        label = "'%s'" % chr(code) if 32 < code < 127 else "%s" % glyphs[code]['name']
+        out.append("\t{ %d, %d, %d },  // %d %s" % (offset, width, advance, code, label))
+    out.append("};")
+    sys.stdout.write("\n".join(out) + "\n")
+
+if __name__ == '__main__':
+    main()
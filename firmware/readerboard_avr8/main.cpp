@@ -30,6 +30,19 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+
+/* Display refresh state, pinned in registers so the refresh ISRs neither
+ * load nor save it. The Makefile reserves r2-r7 with -ffixed-* for every
+ * translation unit. Arguments are passed in r8-r25, so no call can land in
+ * them; libgcc and the avr-libc routines linked here only use
+ * call-clobbered registers, so nothing else touches them.
+ */
+register const uint8_t* refresh_data asm("r2");
+register uint8_t refresh_strobe_d asm("r4");
+register uint8_t refresh_strobe_b asm("r5");
+register uint8_t refresh_off_d asm("r6");	/* PORTD, PORTB with all */
+register uint8_t refresh_off_b asm("r7");	/* strobes off */
 
 void Recv(volatile uint8_t* data, uint8_t count) {
 	while (count--) {
@@ -37,14 +50,6 @@ void Recv(volatile uint8_t* data, uint8_t count) {
 	}
 }
 
-int USB_RecvControl(void* d, int len)
-{
-	usb_wait_for_status_out();
-	Recv((uint8_t*)d,len);
-	usb_clear_out();
-	return len;
-}
-
 typedef enum {
 	DEVICE_STATE_UNINITIALIZED = 0,
 	DEVICE_STATE_INITIALIZE_HARDWARE,
@@ -64,10 +69,17 @@ static void configure_clocks() {
 }
 
 static void configure_power() {
+#if defined(COLUMN_OUTPUT_SPI)
+	/* On: Timer/Counter0, Timer/Counter1, SPI
+	 * Off: (none)
+	 */
+	PRR0 = 0;
+#else
 	/* On: Timer/Counter0, Timer/Counter1
 	 * Off: SPI
 	 */
 	PRR0 = _BV(PRSPI);
+#endif
 	
 	/* On: USB, USART1
 	 * Off: (none)
@@ -79,7 +91,14 @@ static void configure_pins() {
 	MCUCR = 0;
 	
 	PORTB = 0;
+#if defined(COLUMN_OUTPUT_SPI)
+	/* PB1: SCK, PB2: MOSI to the column shift registers. PB0 (/SS) is an
+	 * output, so it cannot drop the SPI out of master mode.
+	 */
+	DDRB = _BV(2) | _BV(1) | _BV(0);
+#else
 	DDRB = _BV(0);
+#endif
 	
 	PORTC = 0;
 	DDRC = _BV(6) | _BV(5) | _BV(4) | _BV(2);
@@ -88,19 +107,14 @@ static void configure_pins() {
 	DDRD = _BV(7) | _BV(6) | _BV(5) | _BV(4) | _BV(3) | _BV(1) | _BV(0);
 }
 
+static void configure_refresh();
+
 static bool configure_hardware() {
 	configure_clocks();
 	configure_power();
 	configure_pins();
 	configure_usb();
-
-	// Configure Timer 3 for ~ 60Hz * 7 (420Hz) interrupt rate.
-	TCCR1A = 0;
-	TCCR1C = 0;
-	TCNT1 = 0;
-	OCR1A = 38095;
-	TIMSK1 = _BV(OCIE1A);
-	TCCR1B = _BV(WGM12) | _BV(CS10);
+	configure_refresh();
 
 	sei();
 
@@ -109,81 +123,15 @@ static bool configure_hardware() {
 	return true;
 }
 
-void strobe_on(const uint8_t i) {
-	switch(i) {
-	case 0:
-		PORTD |= _BV(0);
-		break;
-		
-	case 1:
-		PORTD |= _BV(1);
-		break;
-		
-	case 2:
-		PORTD |= _BV(4);
-		break;
-		
-	case 3:
-		PORTD |= _BV(5);
-		break;
-		
-	case 4:
-		PORTD |= _BV(6);
-		break;
-		
-	case 5:
-		PORTD |= _BV(7);
-		break;
-		
-	case 6:
-		PORTB |= _BV(0);
-		break;
-		
-	default:
-		break;
-	}
-}
-
-void strobe_off(const uint8_t i) {
-	switch(i) {
-	case 0:
-		PORTD &= ~(_BV(0));
-		break;
-		
-	case 1:
-		PORTD &= ~(_BV(1));
-		break;
-		
-	case 2:
-		PORTD &= ~(_BV(4));
-		break;
-		
-	case 3:
-		PORTD &= ~(_BV(5));
-		break;
-		
-	case 4:
-		PORTD &= ~(_BV(6));
-		break;
-		
-	case 5:
-		PORTD &= ~(_BV(7));
-		break;
-		
-	case 6:
-		PORTB &= ~(_BV(0));
-		break;
-		
-	default:
-		break;
-	}
-}
-
 static const uint8_t sign_width = 120;
 static const uint8_t sign_height = 7;
 
 static const uint8_t sign_width_bytes = (sign_width + 7) / 8;
 
+/* Canvas mode joins the two buffers side by side. */
+static const uint8_t canvas_width = 2 * sign_width;
+static const uint8_t canvas_buffer = 2;
+
 uint8_t data_r[2][sign_height][sign_width_bytes]; /* = {
 	{
 		{ 0xF8, 0x78, 0xF8, 0x78, 0xFC, 0xF8, 0x78, 0xF8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
@@ -205,208 +153,294 @@ uint8_t data_r[2][sign_height][sign_width_bytes]; /* = {
 	},
 };
 */
-/*
-uint8_t data_g[2][sign_height][sign_width_bytes]; = {
-	{
-		{ 0xF8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xF8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-	},
-	{
-		{ 0xF8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xF8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-		{ 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-	},
-};
-*/
-PROGMEM const uint8_t character[64][7] = {
-	{ 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000 },  // 32 ' '
-	{ 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b00000000, 0b11000000 },  // 33 '!'
-	{ 0b10100000, 0b10100000, 0b00000000, 0b00000000, 0b00000000, 0b00000000 },  // 34 '"'
-	{ 0b00000000, 0b01010000, 0b11111000, 0b01010000, 0b11111000, 0b01010000 },  // 35 '#'
-	{ 0b00100000, 0b11111000, 0b10100000, 0b11111000, 0b00101000, 0b11111000, 0b00100000 },  // 36 '$'
-	{ 0b00000000, 0b11001000, 0b11010000, 0b00100000, 0b01011000, 0b10011000 },  // 37 '%'
-	{ 0b00000000, 0b00000000, 0b01000000, 0b11100000, 0b01000000, 0b00000000 },  // 38 '+'
-	{ 0b10000000, 0b10000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000 },  // 39 '''
-	{ 0b00100000, 0b01000000, 0b10000000, 0b10000000, 0b01000000, 0b00100000 },  // 40 '('
-	{ 0b10000000, 0b01000000, 0b00100000, 0b00100000, 0b01000000, 0b10000000 },  // 41 ')'
-	{ 0b00000000, 0b10001000, 0b01010000, 0b00100000, 0b01010000, 0b10001000 },  // 42 '*'
-	{ 0b00000000, 0b00100000, 0b00100000, 0b11111000, 0b00100000, 0b00100000 },  // 43 '+'
-	{ 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b11000000, 0b11000000, 0b01000000 },  // 44 ','
-	{ 0b00000000, 0b00000000, 0b11111000, 0b00000000, 0b00000000, 0b00000000 },  // 45 '-'
-	{ 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b11000000, 0b11000000 },  // 46 '.'
-	{ 0b00001000, 0b00010000, 0b00100000, 0b01000000, 0b10000000, 0b00000000 },  // 47 '/'
-	{ 0b11111000, 0b10001000, 0b10001000, 0b10001000, 0b10001000, 0b11111000 },  // 48 '0'
-	{ 0b01100000, 0b00100000, 0b00100000, 0b00100000, 0b00100000, 0b11110000 },  // 49 '1'
-	{ 0b01111000, 0b00001000, 0b11111000, 0b10000000, 0b10000000, 0b11110000 },  // 50 '2'
-	{ 0b01111000, 0b00001000, 0b01111000, 0b00001000, 0b00001000, 0b11111000 },  // 51 '3'
-	{ 0b10000000, 0b10010000, 0b10010000, 0b11111000, 0b00010000, 0b00010000 },  // 52 '4'
-	{ 0b11110000, 0b10000000, 0b11111000, 0b00001000, 0b00001000, 0b11111000 },  // 53 '5'
-	{ 0b11110000, 0b10000000, 0b11111000, 0b10001000, 0b10001000, 0b11111000 },  // 54 '6'
-	{ 0b11111000, 0b00001000, 0b00010000, 0b00100000, 0b01000000, 0b10000000 },  // 55 '7'
-	{ 0b11111000, 0b10001000, 0b11111000, 0b10001000, 0b10001000, 0b11111000 },  // 56 '8'
-	{ 0b11111000, 0b10001000, 0b11111000, 0b00001000, 0b00001000, 0b01111000 },  // 57 '9'
-	{ 0b00000000, 0b11000000, 0b11000000, 0b00000000, 0b11000000, 0b11000000 },  // 58 ':'
-	{ 0b00000000, 0b11000000, 0b11000000, 0b00000000, 0b11000000, 0b11000000, 0b01000000 },  // 59 ';'
-	{ 0b00100000, 0b01000000, 0b10000000, 0b01000000, 0b00100000, 0b00000000 },  // 60 '<'
-	{ 0b00000000, 0b11111000, 0b00000000, 0b11111000, 0b00000000, 0b00000000 },  // 61 '='
-	{ 0b00000000, 0b10000000, 0b01000000, 0b00100000, 0b01000000, 0b10000000 },  // 62 '>'
-	{ 0b01100000, 0b10010000, 0b00110000, 0b01100000, 0b00000000, 0b01100000 },  // 63 '?'
-	{ 0b01000000, 0b10100000, 0b11100000, 0b00000000, 0b11100000, 0b01000000 },  // 64 '@'
-	{ 0b11111000, 0b10011000, 0b11111000, 0b10011000, 0b10011000, 0b10011000 },  // 65 'A'
-	{ 0b11110000, 0b10010000, 0b11111000, 0b11001000, 0b11001000, 0b11111000 },  // 66 'B'
-	{ 0b11111000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11111000 },  // 67 'C'
-	{ 0b11110000, 0b11001000, 0b11001000, 0b11001000, 0b11001000, 0b11110000 },  // 68 'D'
-	{ 0b11111000, 0b10000000, 0b11111000, 0b11000000, 0b11000000, 0b11111000 },  // 69 'E'
-	{ 0b11111000, 0b10000000, 0b11111000, 0b11000000, 0b11000000, 0b11000000 },  // 70 'F'
-	{ 0b11111000, 0b11011000, 0b11000000, 0b11011000, 0b11001000, 0b11111000 },  // 71 'G'
-	{ 0b11001000, 0b11001000, 0b11111000, 0b11001000, 0b11001000, 0b11001000 },  // 72 'H'
-	{ 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000, 0b11000000 },  // 73 'I'
-	{ 0b00001000, 0b00001000, 0b00001000, 0b00001000, 0b11001000, 0b11111000 },  // 74 'J'
-	{ 0b11001000, 0b11010000, 0b11100000, 0b11100000, 0b11010000, 0b11001000 },  // 75 'K'
-	{ 0b10000000, 0b10000000, 0b10000000, 0b10000000, 0b11111000, 0b11111000 },  // 76 'L'
-	{ 0b11111000, 0b10101000, 0b10101000, 0b10001000, 0b10001000, 0b10001000 },  // 77 'M'
-	{ 0b11111000, 0b10001000, 0b11001000, 0b11001000, 0b11001000, 0b11001000 },  // 78 'N'
-	{ 0b11111000, 0b10011000, 0b10001000, 0b10001000, 0b10001000, 0b11111000 },  // 79 'O'
-	{ 0b11111000, 0b10001000, 0b11111000, 0b11000000, 0b11000000, 0b11000000 },  // 80 'P'
-	{ 0b11111000, 0b11001000, 0b11001000, 0b11001000, 0b11010000, 0b11101000 },  // 81 'Q'
-	{ 0b11110000, 0b10010000, 0b11111000, 0b11001000, 0b11001000, 0b11001000 },  // 82 'R'
-	{ 0b11111000, 0b10000000, 0b11111000, 0b00001000, 0b11001000, 0b11111000 },  // 83 'S'
-	{ 0b11111000, 0b00100000, 0b00110000, 0b00110000, 0b00110000, 0b00110000 },  // 84 'T'
-	{ 0b10011000, 0b10011000, 0b10011000, 0b10011000, 0b10011000, 0b11111000 },  // 85 'U'
-	{ 0b11001000, 0b11001000, 0b11001000, 0b11001000, 0b01010000, 0b00100000 },  // 86 'V'
-	{ 0b10001000, 0b10001000, 0b10001000, 0b10101000, 0b10101000, 0b11111000 },  // 87 'W'
-	{ 0b10001000, 0b01010000, 0b00100000, 0b00100000, 0b01010000, 0b10001000 },  // 88 'X'
-	{ 0b11001000, 0b11001000, 0b11111000, 0b00100000, 0b00100000, 0b00100000 },  // 89 'Y'
-	{ 0b11111000, 0b00010000, 0b00100000, 0b01000000, 0b11111000, 0b11111000 },  // 90 'Z'
-	{ 0b11100000, 0b10000000, 0b10000000, 0b10000000, 0b10000000, 0b11100000 },  // 91 '['
-	{ 0b00000000, 0b10000000, 0b01000000, 0b00100000, 0b00010000, 0b00001000 },  // 92 '/'
-	{ 0b11100000, 0b00100000, 0b00100000, 0b00100000, 0b00100000, 0b11000000 },  // 93 '['
-	{ 0b01000000, 0b10100000, 0b00000000, 0b00000000, 0b00000000, 0b00000000 },  // 94 '^'
-	{ 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b00000000, 0b11111000 },  // 95 '_'
-};
+/* There is no SRAM for a separate green frame; in bicolor mode the green
+ * plane is the second buffer.
+ */
+static uint8_t (&data_g)[sign_height][sign_width_bytes] = data_r[1];
+
+/* The built-in font, generated from font_5x7.bdf by bdf2font.py (see the
+ * Makefile). A glyph is the bits at 'offset' to 'offset + width' of each
+ * row of the strike.
+ */
+typedef struct {
+	uint16_t offset;
+	uint8_t width;
+	uint8_t advance;
+} font_glyph_t;
 
-PROGMEM const uint8_t character_attr[64][3] = {
-	{ 0, 0, 4 },  // 32 ' '
-	{ 2, 7, 4 },  // 33 '!'
-	{ 3, 7, 5 },  // 34 '"'
-	{ 5, 7, 7 },  // 35 '#'
-	{ 5, 7, 7 },  // 36 '$'
-	{ 5, 7, 7 },  // 37 '%'
-	{ 3, 7, 5 },  // 38 '+'
-	{ 1, 7, 3 },  // 39 '''
-	{ 3, 7, 5 },  // 40 '('
-	{ 3, 7, 5 },  // 41 ')'
-	{ 5, 7, 7 },  // 42 '*'
-	{ 5, 7, 7 },  // 43 '+'
-	{ 2, 7, 4 },  // 44 ','
-	{ 5, 7, 7 },  // 45 '-'
-	{ 2, 7, 4 },  // 46 '.'
-	{ 5, 7, 7 },  // 47 '/'
-	{ 5, 7, 6 },  // 48 '0'
-	{ 4, 7, 6 },  // 49 '1'
-	{ 5, 7, 6 },  // 50 '2'
-	{ 5, 7, 6 },  // 51 '3'
-	{ 5, 7, 6 },  // 52 '4'
-	{ 5, 7, 6 },  // 53 '5'
-	{ 5, 7, 6 },  // 54 '6'
-	{ 5, 7, 6 },  // 55 '7'
-	{ 5, 7, 6 },  // 56 '8'
-	{ 5, 7, 6 },  // 57 '9'
-	{ 2, 7, 4 },  // 58 ':'
-	{ 2, 7, 4 },  // 59 ';'
-	{ 3, 7, 5 },  // 60 '<'
-	{ 5, 7, 7 },  // 61 '='
-	{ 3, 7, 5 },  // 62 '>'
-	{ 4, 7, 6 },  // 63 '?'
-	{ 3, 7, 5 },  // 64 '@'
-	{ 5, 7, 6 },  // 65 'A'
-	{ 5, 7, 6 },  // 66 'B'
-	{ 5, 7, 6 },  // 67 'C'
-	{ 5, 7, 6 },  // 68 'D'
-	{ 5, 7, 6 },  // 69 'E'
-	{ 5, 7, 6 },  // 70 'F'
-	{ 5, 7, 6 },  // 71 'G'
-	{ 5, 7, 6 },  // 72 'H'
-	{ 2, 7, 3 },  // 73 'I'
-	{ 5, 7, 6 },  // 74 'J'
-	{ 5, 7, 6 },  // 75 'K'
-	{ 5, 7, 6 },  // 76 'L'
-	{ 5, 7, 6 },  // 77 'M'
-	{ 5, 7, 6 },  // 78 'N'
-	{ 5, 7, 6 },  // 79 'O'
-	{ 5, 7, 6 },  // 80 'P'
-	{ 5, 7, 6 },  // 81 'Q'
-	{ 5, 7, 6 },  // 82 'R'
-	{ 5, 7, 6 },  // 83 'S'
-	{ 5, 7, 6 },  // 84 'T'
-	{ 5, 7, 6 },  // 85 'U'
-	{ 5, 7, 6 },  // 86 'V'
-	{ 5, 7, 6 },  // 87 'W'
-	{ 5, 7, 6 },  // 88 'X'
-	{ 5, 7, 6 },  // 89 'Y'
-	{ 5, 7, 6 },  // 90 'Z'
-	{ 3, 7, 5 },  // 91 '['
-	{ 5, 7, 7 },  // 92 '\'
-	{ 3, 7, 5 },  // 93 ']'
-	{ 3, 7, 5 },  // 94 '^'
-	{ 5, 7, 7 },  // 95 '_'
+#include "font.h"
+
+/* Latin-1 160-255 with no glyph of their own are drawn as the closest
+ * ASCII character: accents are dropped, symbols approximated.
+ */
+PROGMEM const char latin1_fold[96] = {
+	' ', '!', 'c', 'L', '*', 'Y', '|', 'S', '"', 'C', 'a', '<', '-', '-', 'R', '-',  // 160-175
+	'o', '+', '2', '3', '\'', 'u', 'P', '.', ',', '1', 'o', '>', '/', '/', '/', '?',  // 176-191
+	'A', 'A', 'A', 'A', 'A', 'A', 'A', 'C', 'E', 'E', 'E', 'E', 'I', 'I', 'I', 'I',  // 192-207
+	'D', 'N', 'O', 'O', 'O', 'O', 'O', '*', 'O', 'U', 'U', 'U', 'U', 'Y', 'P', 's',  // 208-223
+	'a', 'a', 'a', 'a', 'a', 'a', 'a', 'c', 'e', 'e', 'e', 'e', 'i', 'i', 'i', 'i',  // 224-239
+	'd', 'n', 'o', 'o', 'o', 'o', 'o', '/', 'o', 'u', 'u', 'u', 'u', 'y', 'p', 'y',  // 240-255
 };
 
+/* Raster ops: how source pixels combine with the target. BLIT_CLEAR
+ * ignores the source and turns the rectangle off.
+ */
+typedef enum {
+	BLIT_COPY = 0,
+	BLIT_OR = 1,
+	BLIT_AND = 2,
+	BLIT_XOR = 3,
+	BLIT_CLEAR = 4,
+} blit_op_t;
+
+typedef enum {
+	BLIT_SOURCE_PROGMEM = 0,
+	BLIT_SOURCE_RAM = 1,
+	BLIT_SOURCE_EEPROM = 2,
+} blit_source_t;
+
+static inline uint8_t blit_read(const uint8_t* const p, const blit_source_t source) {
+	switch( source ) {
+	case BLIT_SOURCE_RAM:
+		return *p;
+
+	case BLIT_SOURCE_EEPROM:
+		return eeprom_read_byte(p);
+
+	default:
+		return pgm_read_byte(p);
+	}
+}
+
+/* Copies the source rectangle (s_x1, 0) - (s_x2, s_height), from program
+ * memory, SRAM or EEPROM, to the sign buffer 'target' at (t_x1, t_y1),
+ * clipped to the sign.
+ * Works a target byte at a time: up to 8 source bits are gathered (two
+ * reads when they straddle a source byte), shifted to the target bit
+ * offset and combined under a mask. When source and target are
+ * byte-aligned, whole bytes are read and combined.
+ *
+ * Estimated cost, 7-row glyphs at 16MHz: ~60 cycles per target byte
+ * touched per row, so ~420 cycles for an aligned glyph and ~800 for one
+ * straddling two target bytes; a 20-character string is ~14000 cycles
+ * (0.9ms). The per-pixel version took ~45 cycles per pixel, ~2100 per
+ * 6x7 glyph and ~42000 cycles (2.6ms) per 20 characters.
+ */
 void blit(const uint8_t* const source,
 	const uint8_t source_width_bytes,
-	const uint8_t s_x1, const uint8_t s_y1,
-	const uint8_t s_x2, const uint8_t s_y2,
+	const blit_source_t source_memory,
+	const uint8_t s_x1, const uint8_t s_x2, const uint8_t s_height,
 	uint8_t* const target,
-	const uint8_t target_width_bytes,
-	const uint8_t t_x1, const uint8_t t_y1) {
+	const uint8_t t_x1, const uint8_t t_y1,
+	const blit_op_t op) {
+
+	if( (s_x2 <= s_x1) || (t_x1 >= sign_width) ) {
+		return;
+	}
+	uint8_t width = s_x2 - s_x1;
+	if( width > (sign_width - t_x1) ) {
+		width = sign_width - t_x1;
+	}
 
-	uint8_t s_y = s_y1;
-	uint8_t t_y = s_y1;
-	for(; (s_y<s_y2) && (t_y<sign_height); s_y++, t_y++) {
+	const uint8_t* source_row = source;
+	uint8_t* target_row = &target[t_y1 * sign_width_bytes];
+	uint8_t s_y = 0;
+	uint8_t t_y = t_y1;
+	for(; (s_y<s_height) && (t_y<sign_height); s_y++, t_y++) {
 		uint8_t s_x = s_x1;
 		uint8_t t_x = t_x1;
-		for(; (s_x<s_x2) && (t_x<sign_width); s_x++, t_x++) {
-			const uint8_t* const source_address = &source[(s_x >> 3) + s_y * source_width_bytes];
-			const uint8_t pixel_value = (pgm_read_byte(source_address) >> ((s_x & 7) ^ 7)) & 1;
+		uint8_t remaining = width;
+		while( remaining > 0 ) {
+			const uint8_t* const sp = &source_row[s_x >> 3];
+			uint8_t* const tp = &target_row[t_x >> 3];
+			const uint8_t s_shift = s_x & 7;
+			const uint8_t t_shift = t_x & 7;
+
+			uint8_t n;
+			uint8_t bits = 0;
+			uint8_t mask;
+			if( (s_shift == 0) && (t_shift == 0) && (remaining >= 8) ) {
+				n = 8;
+				mask = 0xFF;
+				if( op != BLIT_CLEAR ) {
+					bits = blit_read(sp, source_memory);
+				}
+			} else {
+				n = 8 - t_shift;
+				if( n > remaining ) {
+					n = remaining;
+				}
+				mask = (uint8_t)(0xFF00 >> n) >> t_shift;
+				if( op != BLIT_CLEAR ) {
+					bits = blit_read(sp, source_memory) << s_shift;
+					if( (s_shift + n) > 8 ) {
+						bits |= blit_read(sp + 1, source_memory) >> (8 - s_shift);
+					}
+					bits >>= t_shift;
+				}
+			}
 
-			uint8_t* const target_address = &target[(t_x >> 3) + t_y * target_width_bytes];
-			const uint8_t target_mask = 1 << ((t_x & 7) ^ 7);
+			switch( op ) {
+			case BLIT_OR:
+				*tp |= bits & mask;
+				break;
 
-			if( pixel_value ) {
-				*target_address |= target_mask;
-			} else {
-				*target_address &= ~target_mask;
+			case BLIT_AND:
+				*tp &= bits | ~mask;
+				break;
+
+			case BLIT_XOR:
+				*tp ^= bits & mask;
+				break;
+
+			default:
+				*tp = (*tp & ~mask) | (bits & mask);
+				break;
 			}
+
+			s_x += n;
+			t_x += n;
+			remaining -= n;
 		}
+		source_row += source_width_bytes;
+		target_row += sign_width_bytes;
 	}
 }
 
-void draw_text(const uint8_t buffer_n, uint8_t x, uint8_t y, const char* message) {
-	while( *message != 0 ) {
-		char c = *(message++);
-		if( (c < 32) || (c > 95) ) {
-			c = ' ';
+/* Fonts. FONT_ASCII is printable ASCII with lowercase; FONT_CAPS draws
+ * lowercase as capitals. FONT_USER is uploaded to EEPROM and falls back to
+ * FONT_ASCII for characters it does not have.
+ */
+typedef enum {
+	FONT_ASCII = 0,
+	FONT_CAPS = 1,
+	FONT_USER = 2,
+	FONT_COUNT,
+} font_t;
+
+/* Uploaded glyphs: the advance in the top and the width in the bottom
+ * nibble of byte 0, then 7 rows, MSB first. 36 glyphs (A-Z and 0-9, say)
+ * leave the rest of the EEPROM for the playlist.
+ */
+static const uint8_t user_font_glyphs = 36;
+static const uint8_t user_font_glyph_size = 1 + sign_height;
+
+typedef struct {
+	uint8_t first;
+	uint8_t count;
+	uint8_t glyph[user_font_glyphs][user_font_glyph_size];
+} user_font_t;
+
+EEMEM user_font_t user_font = { 0, 0 };
+
+typedef struct {
+	const uint8_t* bits;
+	blit_source_t source;
+	uint8_t width_bytes;
+	uint8_t x;
+	uint8_t width;
+	uint8_t advance;
+} glyph_t;
+
+static bool font_find(uint8_t font, const uint8_t c, glyph_t* const g) {
+	if( font == FONT_USER ) {
+		const uint8_t index = c - eeprom_read_byte(&user_font.first);
+		const uint8_t count = eeprom_read_byte(&user_font.count);
+		if( (count <= user_font_glyphs) && (index < count) ) {
+			const uint8_t attr = eeprom_read_byte(&user_font.glyph[index][0]);
+			g->bits = &user_font.glyph[index][1];
+			g->source = BLIT_SOURCE_EEPROM;
+			g->width_bytes = 1;
+			g->x = 0;
+			g->width = attr & 0x0F;
+			g->advance = attr >> 4;
+			return true;
+		}
+		font = FONT_ASCII;
+	}
+
+	const uint8_t index = c - font_first;
+	if( (index >= font_count) || ((font == FONT_CAPS) && (c >= 'a') && (c <= 'z')) ) {
+		return false;
+	}
+	const font_glyph_t* const glyph = &font_glyph[index];
+	const uint16_t offset = pgm_read_word(&glyph->offset);
+	g->bits = &font_strike[0][offset >> 3];
+	g->source = BLIT_SOURCE_PROGMEM;
+	g->width_bytes = font_strike_width_bytes;
+	g->x = offset & 7;
+	g->width = pgm_read_byte(&glyph->width);
+	g->advance = pgm_read_byte(&glyph->advance);
+	return true;
+}
+
+/* The next character to try when a font has no glyph for c. Ends at
+ * ' ', which every font has.
+ */
+static uint8_t font_fold(const uint8_t c) {
+	if( (c >= 'a') && (c <= 'z') ) {
+		return c - ('a' - 'A');
+	}
+	if( c >= 160 ) {
+		return pgm_read_byte(&latin1_fold[c - 160]);
+	}
+	return ' ';
+}
+
+static void font_lookup(const uint8_t font, uint8_t c, glyph_t* const g) {
+	while( !font_find(font, c, g) ) {
+		c = font_fold(c);
+	}
+}
+
+/* With ink 0 the glyph's cell is cleared instead of drawn. */
+uint8_t draw_char(uint8_t* const target, const uint8_t x, const uint8_t y, const uint8_t font, uint8_t c, const uint8_t ink) {
+	glyph_t g;
+	font_lookup(font, c, &g);
+	blit(
+		g.bits, g.width_bytes, g.source,
+		g.x, g.x + g.width, sign_height,
+		target,
+		x, y, ink ? BLIT_COPY : BLIT_CLEAR
+	);
+	return g.advance;
+}
+
+/* Draws at column x of the 240-pixel canvas (buffer 0, then buffer 1),
+ * splitting a glyph that crosses from one half to the other, or from the
+ * end of the canvas back to its start.
+ */
+uint8_t draw_char_canvas(const uint8_t x, const uint8_t y, const uint8_t font, uint8_t c) {
+	glyph_t g;
+	font_lookup(font, c, &g);
+
+	uint8_t drawn = 0;
+	uint8_t column = x;
+	while( drawn < g.width ) {
+		const uint8_t half = (column >= sign_width) ? 1 : 0;
+		const uint8_t t_x = column - (half ? sign_width : 0);
+		uint8_t n = g.width - drawn;
+		if( n > (sign_width - t_x) ) {
+			n = sign_width - t_x;
 		}
-		const uint8_t char_index = c - 32;
-		const uint8_t character_width = pgm_read_byte(&character_attr[char_index][0]);
-		const uint8_t character_height = pgm_read_byte(&character_attr[char_index][1]);
 		blit(
-			character[char_index], (character_width + 7) >> 3,
-			0, 0, character_width, character_height,
-			data_r[buffer_n][0], sign_width_bytes,
-			x, y
+			g.bits, g.width_bytes, g.source,
+			g.x + drawn, g.x + drawn + n, sign_height,
+			data_r[half][0],
+			t_x, y, BLIT_COPY
 		);
-		const uint8_t character_spacing = pgm_read_byte(&character_attr[char_index][2]);
-		x += character_spacing;
+		drawn += n;
+		column += n;
+		if( column >= canvas_width ) {
+			column = 0;
+		}
+	}
+	return g.advance;
+}
+
+void draw_text(const uint8_t buffer_n, uint8_t x, uint8_t y, const char* message) {
+	while( *message != 0 ) {
+		x += draw_char(data_r[buffer_n][0], x, y, FONT_ASCII, *(message++), 1);
 	}
 }
 
@@ -414,324 +448,1983 @@ void draw_text(const uint8_t buffer_n, uint8_t x, uint8_t y, const char* message
 #define R_BIT (1 << 5)
 #define G_BIT (1 << 6)
 
+/* current_buffer is what the refresh ISR scans out. show_buffer only sets
+ * pending_buffer; the ISR copies it to current_buffer at the frame
+ * boundary, so a swap never lands in the middle of a refresh.
+ */
 volatile uint8_t current_buffer = 0;
-/*
-#define SEND_BIT(bit_number) \
-	__asm__ __volatile__ ( \
-		"bst  %[r], %[n]\n\t" \
-		"bld  %[value], 6\n\t" \
-		"bst  %[g], %[n]\n\t" \
-		"bld  %[value], 7\n\t" \
-		"out  %[port], %[value]\n\t" \
-		"sbi  %[port], 5\n\t" \
-		: \
-		: [port] "I" (_SFR_IO_ADDR(PORTB)), \
-		[value] "r" (port_b), \
-		[r] "r" (r), \
-		[g] "r" (g), \
-		[n] "I" (bit_number) \
-		: "r0" \
-	)
-*/
-#define SEND_BIT(bit_number) \
-	__asm__ __volatile__ ( \
-		"bst  %[r], %[n]\n\t" \
-		"bld  %[value], 5\n\t" \
-		"out  %[port], %[value]\n\t" \
-		"sbi  %[port], 2\n\t" \
-		: \
-		: [port] "I" (_SFR_IO_ADDR(PORTC)), \
-		[value] "r" (port_c), \
-		[r] "r" (r), \
-		[n] "I" (bit_number) \
-		: "r0" \
-	)
+volatile uint8_t pending_buffer = 0;
 
-volatile bool frame_sync;
+bool buffer_swap_pending() {
+	return pending_buffer != current_buffer;
+}
 
-ISR(TIMER1_COMPA_vect) {
-	static uint8_t current_row = 0;
+/* In grayscale mode the two buffers are the bit planes of one frame:
+ * buffer 0 has weight 1 and buffer 1 weight 2, for four levels per pixel.
+ * Each row is shown for two sub-slots whose lit times are in a 1:2 ratio,
+ * one per plane, so the frame rate is the same as in mono mode.
+ *
+ * In bicolor mode buffer 0 is red and buffer 1 green (data_g below); both
+ * are shifted out together, on G_BIT and R_BIT. Bicolor needs the second
+ * data line, so it is not available with COLUMN_OUTPUT_SPI, and it is
+ * only built with BICOLOR (see the Makefile).
+ *
+ * In canvas mode buffer 0 and buffer 1 are the left and right halves of
+ * one 240-pixel row, shown through the viewport, so a message up to twice
+ * the sign width can scroll around it with no further uploads. Buffer
+ * swaps have no effect.
+ *
+ * In layered mode buffer 0 is a fixed background and buffer 1 a layer
+ * over it, combined byte by byte with layer_op (OR, XOR, ...) as the
+ * row is shifted out. The viewport and row map move the layer only, so text
+ * can scroll across a border or logo that stays where it is, with
+ * nothing to redraw. Buffer swaps have no effect.
+ *
+ * A mode change, like a buffer swap, takes effect at the frame boundary.
+ */
+typedef enum {
+	DISPLAY_MODE_MONO = 0,
+	DISPLAY_MODE_GRAY = 1,
+	DISPLAY_MODE_BICOLOR = 2,
+	DISPLAY_MODE_CANVAS = 3,
+	DISPLAY_MODE_LAYERED = 4,
+} display_mode_t;
+
+#if defined(BICOLOR) && defined(COLUMN_OUTPUT_SPI)
+#error "BICOLOR needs the bit-bang column output"
+#endif
+
+volatile display_mode_t display_mode = DISPLAY_MODE_MONO;
+volatile display_mode_t pending_display_mode = DISPLAY_MODE_MONO;
+
+/* Layered mode: how layer pixels combine with the background. BLIT_CLEAR
+ * turns the background off under the layer, for text cut out of a lit
+ * area. Applied at the frame boundary, with the mode.
+ */
+static blit_op_t layer_op = BLIT_OR;
+volatile blit_op_t pending_layer_op = BLIT_OR;
 
-	strobe_off(current_row);
-	current_row = current_row + 1;
-	if( current_row >= sign_height ) {
-		current_row = 0;
-	}
-	
-	const uint8_t* rp = (const uint8_t*)&data_r[current_buffer][current_row];
-	
-	for(uint8_t col=0; col<sign_width_bytes; col++) {
-		const uint8_t r = *(rp++);
-		const uint8_t port_c = PORTC & (~CLOCK_BIT);
-
-		SEND_BIT(7);
-		SEND_BIT(6);
-		SEND_BIT(5);
-		SEND_BIT(4);
-		SEND_BIT(3);
-		SEND_BIT(2);
-		SEND_BIT(1);
-		SEND_BIT(0);
-	}
-	
-	strobe_on(current_row);
-	
-	if( current_row == (sign_height - 1) ) {
-		frame_sync = true;
+/* Horizontal viewport: the column of the buffer (or canvas) shown at the
+ * left edge of the sign. Columns past the right end of the row wrap to its
+ * start, so scrolling is a change of this offset, not of the buffer. Like
+ * a buffer swap, a new offset takes effect at the frame boundary.
+ *
+ * refresh_wrap is where the shift continues after the end of the row: the
+ * start of the same row, or in canvas mode of the other half.
+ */
+volatile uint8_t pending_view_x = 0;
+static uint8_t refresh_view_half = 0;
+static uint8_t refresh_view_byte = 0;
+static uint8_t refresh_view_bits = 0;
+static const uint8_t* refresh_wrap = &data_r[0][0][0];
+
+/* Viewport range for the pending display mode. */
+static uint8_t view_width() {
+	return (pending_display_mode == DISPLAY_MODE_CANVAS) ? canvas_width : sign_width;
+}
+
+/* A column to clear in the buffer on show as the pending viewport takes
+ * effect: the one a counted scroll brings in at the wrap point, which
+ * until then is still on show at the other edge. view_clear_none if
+ * there is none. Set it together with pending_view_x, with interrupts
+ * off.
+ */
+static const uint8_t view_clear_none = 0xFF;
+volatile uint8_t pending_view_clear = view_clear_none;
+
+/* Row map: sign row n shows row (map[n] & 7) of the displayed buffer, or
+ * of the other buffer if ROW_MAP_OTHER is set. Vertical scrolls and
+ * roll transitions rewrite the map instead of moving row data. In
+ * grayscale and bicolor modes, where the buffers are planes, and in
+ * layered mode, where the map moves the layer, the ROW_MAP_OTHER bit is
+ * ignored.
+ *
+ * row_map_set() queues a whole map, applied at the frame boundary
+ * together with any buffer swap queued in the same frame.
+ */
+static const uint8_t ROW_MAP_OTHER = 0x08;
+
+static uint8_t refresh_row_map[sign_height] = { 0, 1, 2, 3, 4, 5, 6 };
+static uint8_t pending_row_map[sign_height] = { 0, 1, 2, 3, 4, 5, 6 };
+static volatile bool row_map_pending = false;
+static uint8_t refresh_source_row = 0;
+
+/* Layered mode: the layer's viewport (the refresh viewport stays 0, as
+ * the background does not move). refresh_data is the background row and
+ * refresh_wrap the layer row.
+ */
+static uint8_t refresh_layer_byte = 0;
+static uint8_t refresh_layer_bits = 0;
+
+void row_map_set(const uint8_t* const map) {
+	const uint8_t sreg = SREG;
+	cli();
+	for(uint8_t i=0; i<sign_height; i++) {
+		pending_row_map[i] = map[i];
 	}
+	row_map_pending = true;
+	SREG = sreg;
 }
 
-typedef struct {
-	void* state;
-	bool (*update_fn)(void* const state);
-} animation_t;
+/* Row strobe pins, indexed by row: rows 0-5 are on port D, row 6 on B. */
+static const uint8_t strobe_port_d_mask = _BV(7) | _BV(6) | _BV(5) | _BV(4) | _BV(1) | _BV(0);
+static const uint8_t strobe_port_b_mask = _BV(0);
 
-animation_t animation = {
-	0, 0
+PROGMEM const uint8_t strobe_port_d[sign_height] = {
+	_BV(0), _BV(1), _BV(4), _BV(5), _BV(6), _BV(7), 0
 };
 
-typedef struct {
-	uint8_t frame_count;
-	uint8_t frames_per_pixel;
-	uint8_t pixels_remaining;
-} scroll_h_t;
+PROGMEM const uint8_t strobe_port_b[sign_height] = {
+	0, 0, 0, 0, 0, 0, _BV(0)
+};
 
-void scroll_h_init(void* const sv, const uint8_t frames_per_pixel, const uint8_t pixels_remaining) {
-	scroll_h_t* const state = (scroll_h_t* const)sv;
-	state->frame_count = 0;
-	state->frames_per_pixel = frames_per_pixel;
-	state->pixels_remaining = pixels_remaining;
+/* Offset of each row in a buffer. The at90usb162 has no multiplier, and
+ * a call to the multiply helper would make the refresh ISR save every
+ * call-clobbered register.
+ */
+PROGMEM const uint8_t row_offset[sign_height] = {
+	0 * sign_width_bytes, 1 * sign_width_bytes, 2 * sign_width_bytes,
+	3 * sign_width_bytes, 4 * sign_width_bytes, 5 * sign_width_bytes,
+	6 * sign_width_bytes
+};
+
+static inline __attribute__((always_inline)) uint8_t* refresh_row_start(const uint8_t buffer, const uint8_t row) {
+	uint8_t* const p = buffer ? &data_r[1][0][0] : &data_r[0][0][0];
+	return p + pgm_read_byte(&row_offset[row]);
 }
 
-bool scroll_left_update(void* const sv) {
-	scroll_h_t* const state = (scroll_h_t* const)sv;
-	const uint_fast8_t buffer = current_buffer;
-	if( state->pixels_remaining > 0 ) {
-		if( state->frame_count >= state->frames_per_pixel ) {
-			state->frame_count = 0;
-			state->pixels_remaining -= 1;
-			for(uint_fast8_t y=0; y<sign_height; y++) {
-				uint8_t* p = &data_r[buffer][y][sign_width_bytes];
-				uint8_t r = 0;
-				__asm__ __volatile__ ( \
-					"clc\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					"ld   %[r], -%a1\n\t" \
-					"rol  %[r]\n\t" \
-					"st   %a1, %[r]\n\t" \
-					: \
-					: [r] "r" (r), \
-					[p] "e" (p) \
-					: "r0" \
-				);
-			}
-		} else {
-			state->frame_count += 1;
-		}
-		return true;
+/* Shifts one column bit. The data bit is copied into the port image, which
+ * has the clock low; writing the clock bit to PINC then toggles the clock
+ * high. 4 cycles.
+ */
+#define SEND_BIT(bit_number) \
+	"bst  %[r], " #bit_number "\n\t" \
+	"bld  %[value], 5\n\t" \
+	"out  %[port], %[value]\n\t" \
+	"out  %[pin], %[clock]\n\t"
+
+#if defined(BICOLOR)
+/* Shifts one red and one green column bit on the same clock edge.
+ * 6 cycles.
+ */
+#define SEND_BIT_RG(bit_number) \
+	"bst  %[r], " #bit_number "\n\t" \
+	"bld  %[value], 5\n\t" \
+	"bst  %[g], " #bit_number "\n\t" \
+	"bld  %[value], 6\n\t" \
+	"out  %[port], %[value]\n\t" \
+	"out  %[pin], %[clock]\n\t"
+#endif
+
+/* Shifts the top %[count] (1-7) bits of %[r], MSB first, with the data
+ * line on bit %[data] of the port. 8 cycles per bit.
+ */
+#define SEND_TAIL \
+	"1:\n\t" \
+	"bst  %[r], 7\n\t" \
+	"bld  %[value], %[data]\n\t" \
+	"out  %[port], %[value]\n\t" \
+	"out  %[pin], %[clock]\n\t" \
+	"lsl  %[r]\n\t" \
+	"dec  %[count]\n\t" \
+	"brne 1b\n\t"
+
+volatile bool frame_sync;
+volatile uint16_t frame_count = 0;
+
+/* Cycles per slot during which the display is dark for shifting (see the
+ * ISR).
+ */
+#if defined(COLUMN_OUTPUT_SPI)
+static const uint16_t refresh_dark_cycles = 420;
+#else
+static const uint16_t refresh_dark_cycles = 650;
+#endif
+
+/* Frame rate limits: Timer 1 (16MHz, no prescaler) must fit a row in 16
+ * bits, and a grayscale weight 1 slot must stay longer than the shift.
+ */
+static const uint16_t refresh_rate_min = 35;
+static const uint16_t refresh_rate_max = 250;
+
+typedef struct {
+	uint16_t period;	/* OCR1A: slot length - 1 */
+	uint16_t gate;		/* OCR1B: strobes off; past period for full brightness */
+} refresh_slot_t;
+
+typedef enum {
+	REFRESH_SLOT_ROW = 0,
+	REFRESH_SLOT_GRAY_0,
+	REFRESH_SLOT_GRAY_1,
+	REFRESH_SLOT_COUNT,
+} refresh_slot_index_t;
+
+/* Slot timings for a whole row and for the two grayscale sub-slots,
+ * recomputed whenever the frame rate or brightness changes.
+ */
+static refresh_slot_t refresh_slot[REFRESH_SLOT_COUNT];
+static uint16_t refresh_rate = 60;
+static uint8_t refresh_brightness = 255;
+
+/* Timing of the slot the next interrupt starts. */
+static const refresh_slot_t* refresh_timing = &refresh_slot[REFRESH_SLOT_ROW];
+static uint8_t refresh_plane = 0;
+static uint8_t refresh_row = 0;
+
+static uint16_t refresh_gate(const uint16_t slot_cycles) {
+	if( refresh_brightness == 255 ) {
+		return 0xFFFF;
 	}
+	const uint16_t lit_cycles = slot_cycles - refresh_dark_cycles;
+	return refresh_dark_cycles + (((uint32_t)lit_cycles * refresh_brightness) >> 8);
+}
 
-	return false;
+static void refresh_set_slot(const refresh_slot_index_t index, const uint16_t slot_cycles) {
+	const uint16_t gate = refresh_gate(slot_cycles);
+	const uint8_t sreg = SREG;
+	cli();
+	refresh_slot[index].period = slot_cycles - 1;
+	refresh_slot[index].gate = gate;
+	SREG = sreg;
 }
 
-bool scroll_right_update(void* const sv) {
-	scroll_h_t* const state = (scroll_h_t* const)sv;
-	const uint_fast8_t buffer = current_buffer;
-	if( state->pixels_remaining > 0 ) {
-		if( state->frame_count >= state->frames_per_pixel ) {
-			state->frame_count = 0;
-			state->pixels_remaining -= 1;
-			for(uint_fast8_t y=0; y<sign_height; y++) {
-				uint8_t* p = &data_r[buffer][y][0];
-				uint8_t r = 0;
-				__asm__ __volatile__ ( \
-					"clc\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					"ld   %[r], %a1\n\t" \
-					"ror  %[r]\n\t" \
-					"st   %a1+, %[r]\n\t" \
-					: \
-					: [r] "r" (r), \
-					[p] "e" (p) \
-					: "r0" \
-				);
-			}
-		} else {
-			state->frame_count += 1;
-		}
-		return true;
+/* Grayscale sub-slots have lit times in a 1:2 ratio; brightness scales
+ * the lit part of every slot alike, so the ratio holds.
+ */
+static void refresh_configure_timing() {
+	const uint16_t row_cycles = 16000000UL / ((uint32_t)refresh_rate * sign_height);
+	const uint16_t gray_lit_cycles = (row_cycles - (2 * refresh_dark_cycles)) / 3;
+	const uint16_t gray_slot_0_cycles = gray_lit_cycles + refresh_dark_cycles;
+
+	refresh_set_slot(REFRESH_SLOT_ROW, row_cycles);
+	refresh_set_slot(REFRESH_SLOT_GRAY_0, gray_slot_0_cycles);
+	refresh_set_slot(REFRESH_SLOT_GRAY_1, row_cycles - gray_slot_0_cycles);
+}
+
+/* Layered mode: one byte of the sign row, from background byte b and
+ * the two layer bytes under it. It runs in the refresh ISR as each byte
+ * is shifted, so no row of composed bytes needs keeping. The layer bytes
+ * are shifted as a pair, 4 cycles a bit: the at90usb162 has no multiplier,
+ * and a call to the multiply helper would make the ISR save every
+ * call-clobbered register.
+ */
+static inline __attribute__((always_inline)) uint8_t layer_compose(const uint8_t b, const uint8_t left, const uint8_t right) {
+	uint16_t pair = ((uint16_t)left << 8) | right;
+	for(uint8_t n=refresh_layer_bits; n>0; n--) {
+		pair <<= 1;
 	}
+	const uint8_t l = pair >> 8;
+	switch( layer_op ) {
+	case BLIT_COPY:
+		return l;
 
-	return false;
-}
+	case BLIT_AND:
+		return b & l;
 
-scroll_h_t scroll_h;
+	case BLIT_XOR:
+		return b ^ l;
 
-/////////////////////////////////////////////////////////////////////////
+	case BLIT_CLEAR:
+		return b & ~l;
 
-bool usb_set_line(const usb_setup_t& setup) {
-	const uint8_t buffer = setup.bRequest;
-	uint8_t length = setup.wLength_L;
-	if( buffer < 2 ) {
-		usb_wait_for_status_out();
-		uint8_t plane = UEDATX;
-		if( plane == 0 ) {
-			uint8_t row = UEDATX;
-			if( row < sign_height ) {
-				length -= 2;
-				if( length <= sign_width_bytes ) {
-					Recv((uint8_t*)&data_r[buffer][row], length);
-					usb_clear_out();
-					return true;
-				}
-			}
-		}
+	default:
+		return b | l;
 	}
-
-	return false;
 }
 
-bool usb_show_buffer(const uint8_t buffer) {
-	if( (buffer == 0) || (buffer == 1) ) {
-		current_buffer = buffer;
-		return true;
+/* Clears column x of what the sign shows: both planes in grayscale and
+ * bicolor modes, the layer in layered mode, and either half of the
+ * canvas. 7 (or 14) bytes, in the frame boundary's row prep.
+ */
+static void refresh_clear_column(uint8_t x) {
+	uint8_t buffer = current_buffer;
+	uint8_t count = sign_height;
+	if( display_mode == DISPLAY_MODE_CANVAS ) {
+		buffer = 0;
+		if( x >= sign_width ) {
+			x -= sign_width;
+			buffer = 1;
+		}
+	} else if( (display_mode == DISPLAY_MODE_GRAY) || (display_mode == DISPLAY_MODE_BICOLOR) ) {
+		buffer = 0;
+		count = sign_height * 2;
+	} else if( display_mode == DISPLAY_MODE_LAYERED ) {
+		buffer = 1;
+	}
+	const uint8_t mask = ~(0x80 >> (x & 7));
+	uint8_t* p = refresh_row_start(buffer, 0) + (x >> 3);
+	for(uint8_t i=0; i<count; i++) {
+		*p &= mask;
+		p += sign_width_bytes;
 	}
-
-	return false;
 }
 
-bool usb_clear_buffer(const uint8_t buffer) {
-	if( buffer < 2 ) {
-		uint8_t* rp = (uint8_t*)&data_r[buffer];
-		//uint8_t* gp = (uint8_t*)&data_g[buffer];
-		for(uint8_t i=0; i<sizeof(data_r[buffer]); i++) {
-			*(rp++) = 0;
-			//*(gp++) = 0;
+/* Row-prep stage: loads the refresh registers for the row the next
+ * interrupt will display. Runs at the end of the ISR, while the current
+ * row is lit, so the dark window holds nothing but the shift itself.
+ * Reaching row 0 is the frame boundary: the pending buffer swap, mode
+ * change, viewport (and the column it clears) and row map are applied
+ * here, before any row of the next frame has been shifted. refresh_data
+ * points at the viewport's first byte.
+ */
+static inline __attribute__((always_inline)) void refresh_prepare_row(uint8_t row) {
+	if( row >= sign_height ) {
+		row = 0;
+		current_buffer = pending_buffer;
+		display_mode = pending_display_mode;
+		uint8_t x = pending_view_x;
+		refresh_view_half = 0;
+		if( x >= sign_width ) {
+			x -= sign_width;
+			refresh_view_half = (display_mode == DISPLAY_MODE_CANVAS) ? 1 : 0;
 		}
-		return true;
+		refresh_view_byte = x >> 3;
+		refresh_view_bits = x & 7;
+		if( pending_view_clear != view_clear_none ) {
+			refresh_clear_column(pending_view_clear);
+			pending_view_clear = view_clear_none;
+		}
+		if( display_mode == DISPLAY_MODE_LAYERED ) {
+			layer_op = pending_layer_op;
+			refresh_layer_byte = refresh_view_byte;
+			refresh_layer_bits = refresh_view_bits;
+			refresh_view_byte = 0;
+			refresh_view_bits = 0;
+		}
+		if( row_map_pending ) {
+			for(uint8_t i=0; i<sign_height; i++) {
+				refresh_row_map[i] = pending_row_map[i];
+			}
+			row_map_pending = false;
+		}
+		frame_sync = true;
+		frame_count += 1;
 	}
 
-	return false;
+	const uint8_t source = refresh_row_map[row];
+	refresh_source_row = source & 7;
+	refresh_row = row;
+	refresh_plane = 0;
+	if( display_mode == DISPLAY_MODE_GRAY ) {
+		refresh_wrap = refresh_row_start(0, refresh_source_row);
+		refresh_data = refresh_wrap + refresh_view_byte;
+		refresh_timing = &refresh_slot[REFRESH_SLOT_GRAY_0];
+	} else if( display_mode == DISPLAY_MODE_BICOLOR ) {
+		refresh_wrap = refresh_row_start(0, refresh_source_row);
+		refresh_data = refresh_wrap + refresh_view_byte;
+		refresh_timing = &refresh_slot[REFRESH_SLOT_ROW];
+	} else if( display_mode == DISPLAY_MODE_CANVAS ) {
+		refresh_data = refresh_row_start(refresh_view_half, refresh_source_row) + refresh_view_byte;
+		refresh_wrap = refresh_row_start(refresh_view_half ^ 1, refresh_source_row);
+		refresh_timing = &refresh_slot[REFRESH_SLOT_ROW];
+	} else if( display_mode == DISPLAY_MODE_LAYERED ) {
+		refresh_data = refresh_row_start(0, row);
+		refresh_wrap = refresh_row_start(1, refresh_source_row);
+		refresh_timing = &refresh_slot[REFRESH_SLOT_ROW];
+	} else {
+		const uint8_t buffer = (source & ROW_MAP_OTHER) ? (current_buffer ^ 1) : current_buffer;
+		refresh_wrap = refresh_row_start(buffer, refresh_source_row);
+		refresh_data = refresh_wrap + refresh_view_byte;
+		refresh_timing = &refresh_slot[REFRESH_SLOT_ROW];
+	}
+	if( refresh_brightness == 0 ) {
+		refresh_strobe_d = 0;
+		refresh_strobe_b = 0;
+	} else {
+		refresh_strobe_d = pgm_read_byte(&strobe_port_d[row]);
+		refresh_strobe_b = pgm_read_byte(&strobe_port_b[row]);
+	}
 }
 
-typedef struct {
-	uint8_t x, y;
-	char message[32];
-} usb_draw_text_t;
+static void refresh_prepare_next() {
+	if( (display_mode == DISPLAY_MODE_GRAY) && (refresh_plane == 0) ) {
+		/* Same row and strobes, weight 2 plane. */
+		refresh_plane = 1;
+		refresh_wrap = refresh_row_start(1, refresh_source_row);
+		refresh_data = refresh_wrap + refresh_view_byte;
+		refresh_timing = &refresh_slot[REFRESH_SLOT_GRAY_1];
+	} else {
+		refresh_prepare_row(refresh_row + 1);
+	}
+}
 
-bool usb_draw_text(const usb_setup_t& setup) {
-	const uint8_t buffer = setup.wValue_L;
-	uint8_t length = setup.wLength_L;
+static void configure_refresh() {
+	refresh_off_d = PORTD & ~strobe_port_d_mask;
+	refresh_off_b = PORTB & ~strobe_port_b_mask;
+	refresh_configure_timing();
+	refresh_prepare_row(0);
 
-	usb_draw_text_t data;
-	USB_RecvControl(&data, length);
+#if defined(COLUMN_OUTPUT_SPI)
+	/* SPI master, mode 0, MSB first, fosc/2: 8Mbit/s into the shift
+	 * registers.
+	 */
+	SPCR = _BV(SPE) | _BV(MSTR);
+	SPSR = _BV(SPI2X);
+#endif
 
-	if( buffer < 2 ) {
-		data.message[length - 2] = 0;
-		draw_text(buffer, data.x, data.y, &data.message[0]);
-		return true;
-	}
+	// Configure Timer 1 for ~ 60Hz * 7 (420Hz) interrupt rate. The ISR
+	// reloads OCR1A with the length of each slot, and OCR1B with its
+	// brightness gate, as it starts it.
+	TCCR1A = 0;
+	TCCR1C = 0;
+	TCNT1 = 0;
+	OCR1A = refresh_slot[REFRESH_SLOT_ROW].period;
+	OCR1B = 0xFFFF;
+	TIMSK1 = _BV(OCIE1B) | _BV(OCIE1A);
+	TCCR1B = _BV(WGM12) | _BV(CS10);
+}
 
-	return false;
+/* Column shifting. The viewport starts at bit b of byte k of the row, so
+ * the ISR shifts bytes k-14, then 0 to k-1 of the wrap row (the same row,
+ * or the other canvas half), then the top b bits of the wrap row's byte
+ * k: 120 + b bits in all. The chain keeps the last 120, and the first b
+ * (the rest of byte k) fall off the far end.
+ */
+#if defined(COLUMN_OUTPUT_SPI)
+/* The next byte is loaded while the current one shifts out. */
+static inline __attribute__((always_inline)) void shift_bytes(const uint8_t*& rp, uint8_t count) {
+	uint8_t r;
+	__asm__ __volatile__ (
+		"ld   %[r], %a[rp]+\n\t"
+		"1:\n\t"
+		"out  %[spdr], %[r]\n\t"
+		"dec  %[count]\n\t"
+		"breq 3f\n\t"
+		"ld   %[r], %a[rp]+\n\t"
+		"2:\n\t"
+		"in   __tmp_reg__, %[spsr]\n\t"
+		"sbrs __tmp_reg__, %[spif]\n\t"
+		"rjmp 2b\n\t"
+		"rjmp 1b\n\t"
+		"3:\n\t"
+		"in   __tmp_reg__, %[spsr]\n\t"
+		"sbrs __tmp_reg__, %[spif]\n\t"
+		"rjmp 3b\n\t"
+		: [rp] "+e" (rp),
+		[count] "+r" (count),
+		[r] "=&r" (r)
+		: [spdr] "I" (_SFR_IO_ADDR(SPDR)),
+		[spsr] "I" (_SFR_IO_ADDR(SPSR)),
+		[spif] "I" (SPIF)
+	);
 }
 
-typedef struct {
-	uint8_t frames_per_pixel;
-	uint8_t pixel_count;
-} usb_animate_scroll_h_t;
+/* The SPI only moves whole bytes, so the tail is bit-banged on the same
+ * pins (PB2 data, PB1 clock) with the SPI disabled for the duration.
+ */
+static inline __attribute__((always_inline)) void shift_tail(uint8_t r, uint8_t count) {
+	uint8_t port_b = refresh_off_b;
+	SPCR = _BV(MSTR);
+	__asm__ __volatile__ (
+		SEND_TAIL
+		: [r] "+r" (r),
+		[count] "+r" (count),
+		[value] "+r" (port_b)
+		: [port] "I" (_SFR_IO_ADDR(PORTB)),
+		[pin] "I" (_SFR_IO_ADDR(PINB)),
+		[data] "I" (2),
+		[clock] "r" ((uint8_t)_BV(1))
+	);
+	PORTB = refresh_off_b;
+	SPCR = _BV(SPE) | _BV(MSTR);
+}
+#else
+static inline __attribute__((always_inline)) void shift_bytes(const uint8_t*& rp, uint8_t count, uint8_t& port_c) {
+	uint8_t r;
+	__asm__ __volatile__ (
+		"1:\n\t"
+		"ld   %[r], %a[rp]+\n\t"
+		SEND_BIT(7)
+		SEND_BIT(6)
+		SEND_BIT(5)
+		SEND_BIT(4)
+		SEND_BIT(3)
+		SEND_BIT(2)
+		SEND_BIT(1)
+		SEND_BIT(0)
+		"dec  %[count]\n\t"
+		"brne 1b\n\t"
+		: [rp] "+e" (rp),
+		[count] "+r" (count),
+		[value] "+r" (port_c),
+		[r] "=&r" (r)
+		: [port] "I" (_SFR_IO_ADDR(PORTC)),
+		[pin] "I" (_SFR_IO_ADDR(PINC)),
+		[clock] "r" ((uint8_t)CLOCK_BIT)
+	);
+}
+
+#if defined(BICOLOR)
+static inline __attribute__((always_inline)) void shift_bytes_rg(const uint8_t*& rp, const uint8_t*& gp, uint8_t count, uint8_t& port_c) {
+	uint8_t r;
+	uint8_t g;
+	__asm__ __volatile__ (
+		"1:\n\t"
+		"ld   %[r], %a[rp]+\n\t"
+		"ld   %[g], %a[gp]+\n\t"
+		SEND_BIT_RG(7)
+		SEND_BIT_RG(6)
+		SEND_BIT_RG(5)
+		SEND_BIT_RG(4)
+		SEND_BIT_RG(3)
+		SEND_BIT_RG(2)
+		SEND_BIT_RG(1)
+		SEND_BIT_RG(0)
+		"dec  %[count]\n\t"
+		"brne 1b\n\t"
+		: [rp] "+e" (rp),
+		[gp] "+e" (gp),
+		[count] "+r" (count),
+		[value] "+r" (port_c),
+		[r] "=&r" (r),
+		[g] "=&r" (g)
+		: [port] "I" (_SFR_IO_ADDR(PORTC)),
+		[pin] "I" (_SFR_IO_ADDR(PINC)),
+		[clock] "r" ((uint8_t)CLOCK_BIT)
+	);
+}
+
+#endif
+
+static inline __attribute__((always_inline)) void shift_tail(uint8_t r, uint8_t count, uint8_t& port_c) {
+	__asm__ __volatile__ (
+		SEND_TAIL
+		: [r] "+r" (r),
+		[count] "+r" (count),
+		[value] "+r" (port_c)
+		: [port] "I" (_SFR_IO_ADDR(PORTC)),
+		[pin] "I" (_SFR_IO_ADDR(PINC)),
+		[data] "I" (5),
+		[clock] "r" ((uint8_t)CLOCK_BIT)
+	);
+}
+
+#if defined(BICOLOR)
+/* 10 cycles per bit. */
+static inline __attribute__((always_inline)) void shift_tail_rg(uint8_t r, uint8_t g, uint8_t count, uint8_t& port_c) {
+	__asm__ __volatile__ (
+		"1:\n\t"
+		"bst  %[r], 7\n\t"
+		"bld  %[value], 5\n\t"
+		"bst  %[g], 7\n\t"
+		"bld  %[value], 6\n\t"
+		"out  %[port], %[value]\n\t"
+		"out  %[pin], %[clock]\n\t"
+		"lsl  %[r]\n\t"
+		"lsl  %[g]\n\t"
+		"dec  %[count]\n\t"
+		"brne 1b\n\t"
+		: [r] "+r" (r),
+		[g] "+r" (g),
+		[count] "+r" (count),
+		[value] "+r" (port_c)
+		: [port] "I" (_SFR_IO_ADDR(PORTC)),
+		[pin] "I" (_SFR_IO_ADDR(PINC)),
+		[clock] "r" ((uint8_t)CLOCK_BIT)
+	);
+}
+#endif
+#endif
+
+/* The display is dark from the strobe-off write to the strobe-on write.
+ * Cycle counts for that window (16MHz):
+ *
+ *   before: strobe_off() call and switch, row/frame bookkeeping, row
+ *           address multiply, then per byte ld + PORTC read/mask + 8 x 5
+ *           cycles (bst, bld, out, sbi) + loop = ~47, and strobe_on():
+ *           ~790 cycles, 49us.
+ *   after:  two port writes, 15 x (ld 2 + 8 x 4 + loop 3) - 1, two port
+ *           writes: ~560 cycles, 35us.
+ *   SPI:    two port writes, 15 x (16 cycle transfer + SPIF poll and
+ *           reload ~4), two port writes: ~310 cycles, 19us.
+ *   bicolor: two port writes, 15 x (2 x ld 2 + 8 x 6 + loop 3) - 1, two
+ *           port writes: ~830 cycles, 52us. That is 2 cycles a bit more
+ *           than mono, and longer dark than even 'before', which is why
+ *           it is only built with BICOLOR. A single 'out' per bit needs
+ *           the port images precomputed, 120 bytes of SRAM for a row (60
+ *           packing two columns a byte), and the stack needs that SRAM.
+ *   layered: each byte is composed (3 loads, wrap, a 4 cycle shift per
+ *           bit of layer offset, op) before it is shifted, ~20-50 cycles
+ *           more per byte: ~900-1350 cycles, 56-84us, or ~650-1100 with
+ *           SPI. Less lit time than mono, for 15 bytes of SRAM that a
+ *           composed row would need.
+ *
+ * A viewport that is not byte-aligned adds up to ~15 cycles for the
+ * wrap and 8 per tail bit (10 bicolor): at most ~70 cycles, 4us. With SPI
+ * the tail is bit-banged, ~90 cycles at most.
+ *
+ * Everything else (SREG and scratch register saves, reading the port
+ * images, row prep) happens while a row is lit.
+ */
+ISR(TIMER1_COMPA_vect) {
+	/* Armed before the dark window, so a gate that passes during the shift
+	 * still fires (as soon as this ISR returns).
+	 */
+	OCR1A = refresh_timing->period;
+	OCR1B = refresh_timing->gate;
+
+	const uint8_t port_d_on = refresh_off_d | refresh_strobe_d;
+	const uint8_t port_b_on = refresh_off_b | refresh_strobe_b;
+	const uint8_t* rp = refresh_data;
+	const uint8_t* const wrap = refresh_wrap;
+	const uint8_t view_byte = refresh_view_byte;
+	const uint8_t view_bits = refresh_view_bits;
+	const bool layered = (display_mode == DISPLAY_MODE_LAYERED);
+#if !defined(COLUMN_OUTPUT_SPI)
+	/* Green is shifted only in bicolor mode; otherwise G stays low. */
+	uint8_t port_c = PORTC & ~(CLOCK_BIT | G_BIT);
+#endif
+#if defined(BICOLOR)
+	const bool bicolor = (display_mode == DISPLAY_MODE_BICOLOR);
+	const uint8_t* gp = rp + sizeof(data_r[0]);
+#endif
+
+	PORTD = refresh_off_d;
+	PORTB = refresh_off_b;
+
+#if defined(COLUMN_OUTPUT_SPI)
+	if( layered ) {
+		uint8_t k = refresh_layer_byte;
+		uint8_t left = wrap[k];
+		for(uint8_t i=0; i<sign_width_bytes; i++) {
+			k = (k == (sign_width_bytes - 1)) ? 0 : (k + 1);
+			const uint8_t right = wrap[k];
+			const uint8_t out = layer_compose(rp[i], left, right);
+			const uint8_t* op = &out;
+			shift_bytes(op, 1);
+			left = right;
+		}
+	} else {
+		shift_bytes(rp, sign_width_bytes - view_byte);
+		rp = wrap;
+		if( view_byte ) {
+			shift_bytes(rp, view_byte);
+		}
+		if( view_bits ) {
+			shift_tail(*rp, view_bits);
+		}
+	}
+#else
+	if( layered ) {
+		uint8_t k = refresh_layer_byte;
+		uint8_t left = wrap[k];
+		for(uint8_t i=0; i<sign_width_bytes; i++) {
+			k = (k == (sign_width_bytes - 1)) ? 0 : (k + 1);
+			const uint8_t right = wrap[k];
+			const uint8_t out = layer_compose(rp[i], left, right);
+			const uint8_t* op = &out;
+			shift_bytes(op, 1, port_c);
+			left = right;
+		}
+#if defined(BICOLOR)
+	} else if( bicolor ) {
+		shift_bytes_rg(rp, gp, sign_width_bytes - view_byte, port_c);
+		rp = wrap;
+		gp = wrap + sizeof(data_r[0]);
+		if( view_byte ) {
+			shift_bytes_rg(rp, gp, view_byte, port_c);
+		}
+		if( view_bits ) {
+			shift_tail_rg(*rp, *gp, view_bits, port_c);
+		}
+#endif
+	} else {
+		shift_bytes(rp, sign_width_bytes - view_byte, port_c);
+		rp = wrap;
+		if( view_byte ) {
+			shift_bytes(rp, view_byte, port_c);
+		}
+		if( view_bits ) {
+			shift_tail(*rp, view_bits, port_c);
+		}
+	}
+#endif
+
+	PORTB = port_b_on;
+	PORTD = port_d_on;
+
+	refresh_prepare_next();
+}
+
+/* Brightness gate: turns the row off partway through its slot. It only
+ * writes the pinned port images (r6, r7), so it needs no prologue and
+ * costs about 10 cycles per slot, nothing per pixel.
+ */
+ISR(TIMER1_COMPB_vect, ISR_NAKED) {
+	__asm__ __volatile__ (
+		"out  %[portd], r6\n\t"
+		"out  %[portb], r7\n\t"
+		"reti\n\t"
+		:
+		: [portd] "I" (_SFR_IO_ADDR(PORTD)),
+		[portb] "I" (_SFR_IO_ADDR(PORTB))
+	);
+}
+
+typedef struct {
+	void* state;
+	bool (*update_fn)(void* const state);
+} animation_t;
+
+animation_t animation = {
+	0, 0
+};
+
+/* A looping scroll never finishes; it runs until stopped.
+ *
+ * A scroll of the whole sign moves the viewport one column per step, and
+ * leaves it where the scroll ends. A looping scroll, or any scroll in
+ * canvas mode, lets the content wrap around. A counted scroll in the
+ * other modes brings in blank columns, as it always has, so 120 pixels
+ * clear the sign: each step clears the column coming in at the wrap point
+ * as the viewport moves (see pending_view_clear). Either way a step costs
+ * the same for any buffer size and is tear-free.
+ *
+ * A window scroll moves the bits of its window, columns x1 to x2 - 1 of
+ * rows y1 to y2 - 1, leaving everything around it, and the viewport, in
+ * place. Blank columns come in, or with 'loop' the window rotates.
+ *
+ * No frame shows a half-moved window. In mono mode each step is drawn
+ * into the hidden buffer, from the shown one, and the two are swapped at
+ * the next frame boundary. The first step copies the whole frame across;
+ * after that the hidden buffer is the frame before, the same outside the
+ * window, so a step writes only the window's bytes. The buffers take
+ * turns, and when the scroll ends (or is stopped) the last frame is
+ * copied back to the buffer it started on. Both buffers belong to the
+ * scroll while it runs.
+ *
+ * In the other modes the buffers are on show, so the window moves in
+ * place (both planes in gray and bicolor modes, the layer in layered
+ * mode), a row at a time just behind the scan: each row changes after
+ * the frame in progress has shown it, and before the next frame does.
+ * The step waits for the scan, up to one frame, but writes no more than
+ * the window.
+ */
+typedef struct {
+	uint8_t frame_count;
+	uint8_t frames_per_pixel;
+	uint8_t pixels_remaining;
+	bool loop;
+	bool shift;
+	bool blank;
+	bool primed;
+	uint8_t buffer;
+	uint8_t x1;
+	uint8_t x2;
+	uint8_t y1;
+	uint8_t y2;
+} scroll_h_t;
+
+void scroll_h_init(void* const sv, const uint8_t frames_per_pixel, const uint8_t pixels_remaining, const bool loop,
+	const uint8_t x1, const uint8_t x2, const uint8_t y1, const uint8_t y2) {
+	scroll_h_t* const state = (scroll_h_t* const)sv;
+	state->frame_count = 0;
+	state->frames_per_pixel = frames_per_pixel;
+	state->pixels_remaining = loop ? 1 : pixels_remaining;
+	state->loop = loop;
+	const bool window = (x1 != 0) || (x2 != sign_width) || (y1 != 0) || (y2 != sign_height);
+	state->shift = window;
+	state->blank = !window && !loop && (pending_display_mode != DISPLAY_MODE_CANVAS);
+	state->primed = false;
+	state->buffer = pending_buffer;
+	state->x1 = x1;
+	state->x2 = x2;
+	state->y1 = y1;
+	state->y2 = y2;
+}
+
+/* Bits of byte b that fall in columns x1 to x2 - 1. */
+static uint8_t window_mask(const uint8_t b, const uint8_t x1, const uint8_t x2) {
+	const uint8_t left = b << 3;
+	const uint8_t lo = (x1 > left) ? (x1 - left) : 0;
+	const uint8_t hi = (x2 < (left + 8)) ? (x2 - left) : 8;
+	return (uint8_t)(0xFF >> lo) & (uint8_t)(0xFF << (8 - hi));
+}
+
+static uint8_t column_bit(const uint8_t x) {
+	return 0x80 >> (x & 7);
+}
+
+/* Writes 'from' to 'to' (which may be the same row) with columns x1 + 1
+ * to x2 - 1 moved one to the left; 'in' fills x2 - 1. Only the bytes the
+ * window touches are written.
+ */
+static void window_shift_left(const uint8_t* const from, uint8_t* const to, const uint8_t x1, const uint8_t x2, const bool in) {
+	const uint8_t first = x1 >> 3;
+	const uint8_t last = (x2 - 1) >> 3;
+	uint8_t carry = 0;
+	for(uint8_t b=last; ; b--) {
+		const uint8_t v = from[b];
+		uint8_t shifted = (v << 1) | carry;
+		if( b == last ) {
+			const uint8_t bit = column_bit(x2 - 1);
+			shifted = in ? (shifted | bit) : (shifted & ~bit);
+		}
+		const uint8_t mask = window_mask(b, x1, x2);
+		to[b] = (v & ~mask) | (shifted & mask);
+		carry = v >> 7;
+		if( b == first ) {
+			break;
+		}
+	}
+}
+
+/* As window_shift_left, with columns x1 to x2 - 2 moved one to the
+ * right; 'in' fills x1.
+ */
+static void window_shift_right(const uint8_t* const from, uint8_t* const to, const uint8_t x1, const uint8_t x2, const bool in) {
+	const uint8_t first = x1 >> 3;
+	const uint8_t last = (x2 - 1) >> 3;
+	uint8_t carry = 0;
+	for(uint8_t b=first; b<=last; b++) {
+		const uint8_t v = from[b];
+		uint8_t shifted = (v >> 1) | carry;
+		if( b == first ) {
+			const uint8_t bit = column_bit(x1);
+			shifted = in ? (shifted | bit) : (shifted & ~bit);
+		}
+		const uint8_t mask = window_mask(b, x1, x2);
+		to[b] = (v & ~mask) | (shifted & mask);
+		carry = v << 7;
+	}
+}
+
+/* One step of the window in one row, from 'from' to 'to' (which may be
+ * the same row).
+ */
+static void scroll_h_row(const scroll_h_t* const state, const uint8_t* const from, uint8_t* const to, const bool left) {
+	if( left ) {
+		const bool in = state->loop && (from[state->x1 >> 3] & column_bit(state->x1));
+		window_shift_left(from, to, state->x1, state->x2, in);
+	} else {
+		const uint8_t x = state->x2 - 1;
+		const bool in = state->loop && (from[x >> 3] & column_bit(x));
+		window_shift_right(from, to, state->x1, state->x2, in);
+	}
+}
+
+/* Sign rows that show row y of the buffers are all shifted out once the
+ * scan is past the last of them: this many rows into the frame.
+ */
+static uint8_t row_map_reach(const uint8_t y) {
+	uint8_t reach = 0;
+	for(uint8_t n=0; n<sign_height; n++) {
+		if( (refresh_row_map[n] & 7) == y ) {
+			reach = n + 1;
+		}
+	}
+	return reach;
+}
+
+static void scroll_h_in_place(const scroll_h_t* const state, const bool left) {
+	uint8_t buffer = current_buffer;
+	uint8_t planes = 1;
+	if( (display_mode == DISPLAY_MODE_GRAY) || (display_mode == DISPLAY_MODE_BICOLOR) ) {
+		buffer = 0;
+		planes = 2;
+	} else if( display_mode == DISPLAY_MODE_LAYERED ) {
+		buffer = 1;
+	}
+
+	uint8_t sreg = SREG;
+	cli();
+	const uint16_t frame = frame_count;
+	SREG = sreg;
+
+	uint8_t todo = (uint8_t)(0xFF << state->y1) & (uint8_t)~(0xFF << state->y2);
+	while( todo != 0 ) {
+		/* Rows the scan has shifted out in 'frame'; all of them once it
+		 * is over.
+		 */
+		sreg = SREG;
+		cli();
+		const uint8_t done = (frame_count == frame) ? refresh_row : sign_height;
+		SREG = sreg;
+
+		for(uint8_t y=state->y1; y<state->y2; y++) {
+			const uint8_t bit = 1 << y;
+			if( (todo & bit) && (row_map_reach(y) <= done) ) {
+				for(uint8_t p=0; p<planes; p++) {
+					uint8_t* const row = data_r[buffer + p][y];
+					scroll_h_row(state, row, row, left);
+				}
+				todo &= ~bit;
+			}
+		}
+	}
+}
+
+static void scroll_h_window(scroll_h_t* const state, const bool left) {
+	if( display_mode != DISPLAY_MODE_MONO ) {
+		scroll_h_in_place(state, left);
+		return;
+	}
+
+	const uint8_t from_buffer = current_buffer;
+	const uint8_t to_buffer = from_buffer ^ 1;
+	if( !state->primed ) {
+		const uint8_t* const from = &data_r[from_buffer][0][0];
+		uint8_t* const to = &data_r[to_buffer][0][0];
+		for(uint8_t i=0; i<sizeof(data_r[0]); i++) {
+			to[i] = from[i];
+		}
+		state->primed = true;
+	}
+	for(uint8_t y=state->y1; y<state->y2; y++) {
+		scroll_h_row(state, data_r[from_buffer][y], data_r[to_buffer][y], left);
+	}
+	pending_buffer = to_buffer;
+}
+
+/* Moves the viewport one column; a blanking scroll clears the column
+ * that comes in, which is the one leaving at the other edge.
+ */
+static void scroll_h_viewport(const scroll_h_t* const state, const bool left) {
+	const uint8_t width = view_width();
+	const uint8_t x = pending_view_x;
+	uint8_t next;
+	uint8_t in;
+	if( left ) {
+		next = (x + 1 >= width) ? 0 : (x + 1);
+		in = x;
+	} else {
+		next = ((x == 0) ? width : x) - 1;
+		in = next;
+	}
+	const uint8_t sreg = SREG;
+	cli();
+	pending_view_x = next;
+	if( state->blank ) {
+		pending_view_clear = in;
+	}
+	SREG = sreg;
+}
+
+static bool scroll_h_update(scroll_h_t* const state, const bool left) {
+	if( (state->shift && buffer_swap_pending()) || (pending_view_clear != view_clear_none) ) {
+		/* The last step is not on show yet. */
+		return true;
+	}
+	if( state->pixels_remaining > 0 ) {
+		if( state->frame_count >= state->frames_per_pixel ) {
+			state->frame_count = 0;
+			if( !state->loop ) {
+				state->pixels_remaining -= 1;
+			}
+			if( state->shift ) {
+				scroll_h_window(state, left);
+			} else {
+				scroll_h_viewport(state, left);
+			}
+		} else {
+			state->frame_count += 1;
+		}
+		return true;
+	}
+
+	if( state->shift && (current_buffer != state->buffer) ) {
+		const uint8_t* const from = &data_r[current_buffer][0][0];
+		uint8_t* const to = &data_r[state->buffer][0][0];
+		for(uint8_t i=0; i<sizeof(data_r[0]); i++) {
+			to[i] = from[i];
+		}
+		pending_buffer = state->buffer;
+		return true;
+	}
+
+	return false;
+}
+
+bool scroll_left_update(void* const sv) {
+	return scroll_h_update((scroll_h_t* const)sv, true);
+}
+
+bool scroll_right_update(void* const sv) {
+	return scroll_h_update((scroll_h_t* const)sv, false);
+}
+
+/* Ends a scroll at once, keeping the last step that reached the sign. A
+ * shifting scroll leaves the buffer it started on as the one on show from
+ * the next frame, so the host can draw on the other as before.
+ */
+static void scroll_h_stop(const scroll_h_t* const state) {
+	if( !state->shift ) {
+		return;
+	}
+	bool copy = false;
+	const uint8_t sreg = SREG;
+	cli();
+	if( pending_buffer != state->buffer ) {
+		if( current_buffer == state->buffer ) {
+			/* The step in the other buffer never made it on show. */
+			pending_buffer = state->buffer;
+		} else {
+			/* No swap is pending, so current_buffer stays put. */
+			copy = true;
+		}
+	}
+	SREG = sreg;
+	if( copy ) {
+		const uint8_t* const from = &data_r[current_buffer][0][0];
+		uint8_t* const to = &data_r[state->buffer][0][0];
+		for(uint8_t i=0; i<sizeof(data_r[0]); i++) {
+			to[i] = from[i];
+		}
+		pending_buffer = state->buffer;
+	}
+}
+
+
+/* Vertical scrolling, by rewriting the row map. A wrapping scroll brings
+ * rows that leave one edge back in at the other; it may be limited to
+ * rows y1 to y2 - 1, the others staying put. A roll brings in the other
+ * buffer instead; after 7 rows it is shown in full and the map is back to
+ * normal, and the buffer swap lands on the same frame. A roll always
+ * covers the whole sign.
+ */
+typedef struct {
+	uint8_t frame_count;
+	uint8_t frames_per_row;
+	uint8_t rows_remaining;
+	uint8_t offset;
+	bool up;
+	bool roll;
+	uint8_t y1;
+	uint8_t height;
+} scroll_v_t;
+
+void scroll_v_init(void* const sv, const uint8_t frames_per_row, const uint8_t rows, const bool up, const bool roll,
+	const uint8_t y1, const uint8_t y2) {
+	scroll_v_t* const state = (scroll_v_t* const)sv;
+	state->frame_count = 0;
+	state->frames_per_row = frames_per_row;
+	state->rows_remaining = roll ? sign_height : rows;
+	state->offset = 0;
+	state->up = up;
+	state->roll = roll;
+	state->y1 = y1;
+	state->height = y2 - y1;
+}
+
+bool scroll_v_update(void* const sv) {
+	scroll_v_t* const state = (scroll_v_t* const)sv;
+	if( state->rows_remaining > 0 ) {
+		if( state->frame_count >= state->frames_per_row ) {
+			state->frame_count = 0;
+			state->rows_remaining -= 1;
+			state->offset += 1;
+			if( state->offset > state->height ) {
+				state->offset = 1;
+			}
+
+			/* Scrolling up, row n of the range shows row n + offset; rows
+			 * past the bottom come from the top (wrap) or from the other
+			 * buffer (roll). Scrolling down is the mirror image.
+			 */
+			const uint8_t h = state->height;
+			uint8_t map[sign_height];
+			for(uint8_t n=0; n<sign_height; n++) {
+				if( (n < state->y1) || (n >= (state->y1 + h)) ) {
+					map[n] = n;
+					continue;
+				}
+				uint8_t v = (n - state->y1) + (state->up ? state->offset : (h - state->offset));
+				bool other;
+				if( v >= h ) {
+					v -= h;
+					other = state->up;
+				} else {
+					other = !state->up;
+				}
+				map[n] = (state->y1 + v) | ((other && state->roll) ? ROW_MAP_OTHER : 0);
+			}
+			/* Offset 7 is the identity map, plus the other buffer if
+			 * rolling: finish on the plain map. The swap and the map must
+			 * reach the same frame boundary.
+			 */
+			const uint8_t sreg = SREG;
+			cli();
+			if( state->offset == h ) {
+				for(uint8_t n=0; n<sign_height; n++) {
+					map[n] = n;
+				}
+				if( state->roll ) {
+					pending_buffer = current_buffer ^ 1;
+				}
+			}
+			row_map_set(map);
+			SREG = sreg;
+		} else {
+			state->frame_count += 1;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+
+/* Transitions from the shown buffer to the hidden one, which the host
+ * (or a playlist) has drawn; when one ends the hidden buffer is on show,
+ * as after a buffer swap.
+ *
+ *   wipe:     columns change over, left to right or right to left.
+ *   dissolve: pixels change over in a pseudo-random order, the states of
+ *             a 10-bit maximal LFSR (row in the top 3 bits, column in the
+ *             bottom 7; states off the sign are skipped).
+ *   slide:    the new frame pushes the old one off to the left or right.
+ *   blind:    rows change over, even rows first, then odd.
+ *
+ * The blind is a row map and the slide a canvas viewport, applied at the
+ * frame boundary like any other. The wipe and dissolve copy pixels into
+ * the shown buffer: each pixel changes once, from old to new, so a row
+ * reached by the scan before its step shows that step a frame later, and
+ * nothing moves. 'step' is columns, pixels or rows per step.
+ *
+ * A step runs in animate(), and must fit in one row slot at
+ * refresh_rate_max: 16 MHz / (250 x 7), ~9.1k cycles, less the refresh
+ * ISR. A wipe column is 7 pixel copies at ~65 cycles, ~470 cycles, and a
+ * dissolve pixel ~85 with the LFSR states off the sign, so the step is
+ * held to 12 columns or 64 pixels, ~5.5k cycles. A slide or blind step
+ * costs the same whatever its size. Transitions are for mono mode;
+ * stopping one skips to its end.
+ */
+typedef enum {
+	TRANSITION_WIPE_RIGHT = 0,
+	TRANSITION_WIPE_LEFT = 1,
+	TRANSITION_DISSOLVE = 2,
+	TRANSITION_SLIDE_LEFT = 3,
+	TRANSITION_SLIDE_RIGHT = 4,
+	TRANSITION_BLIND = 5,
+	TRANSITION_COUNT,
+} transition_type_t;
+
+static const uint8_t transition_wipe_step_max = 12;
+static const uint8_t transition_dissolve_step_max = 64;
+
+static const uint16_t dissolve_lfsr_mask = 0x240;
+
+PROGMEM const uint8_t blind_order[sign_height] = { 0, 2, 4, 6, 1, 3, 5 };
+
+typedef struct {
+	uint8_t type;
+	uint8_t frame_count;
+	uint8_t frames_per_step;
+	uint8_t step;
+	bool started;
+	uint8_t from;
+	uint8_t to;
+	uint16_t position;
+} transition_t;
+
+void transition_init(void* const tv, const uint8_t type, const uint8_t frames_per_step, const uint8_t step) {
+	transition_t* const t = (transition_t* const)tv;
+	t->type = type;
+	t->frame_count = 0;
+	t->frames_per_step = frames_per_step;
+	uint8_t step_max = 0xFF;
+	if( (type == TRANSITION_WIPE_RIGHT) || (type == TRANSITION_WIPE_LEFT) ) {
+		step_max = transition_wipe_step_max;
+	} else if( type == TRANSITION_DISSOLVE ) {
+		step_max = transition_dissolve_step_max;
+	}
+	t->step = (step == 0) ? 1 : ((step > step_max) ? step_max : step);
+	t->started = false;
+}
+
+static void transition_copy_pixel(const transition_t* const t, const uint8_t x, const uint8_t y) {
+	const uint8_t bit = column_bit(x);
+	uint8_t* const p = &data_r[t->from][y][x >> 3];
+	*p = (*p & ~bit) | (data_r[t->to][y][x >> 3] & bit);
+}
+
+/* Sets everything for the frame after the last step at once: the new
+ * buffer, plain mono display and row map, and the viewport.
+ */
+static void transition_finish(const transition_t* const t, const uint8_t view_x) {
+	uint8_t map[sign_height];
+	for(uint8_t n=0; n<sign_height; n++) {
+		map[n] = n;
+	}
+	const uint8_t sreg = SREG;
+	cli();
+	pending_buffer = t->to;
+	pending_display_mode = DISPLAY_MODE_MONO;
+	pending_view_x = view_x;
+	row_map_set(map);
+	SREG = sreg;
+}
+
+/* Puts the end of the transition on show from the next frame, whether
+ * or not it has got there.
+ */
+static void transition_end(const transition_t* const t) {
+	if( !t->started ) {
+		return;
+	}
+	uint8_t view_x = pending_view_x;
+	if( view_x >= sign_width ) {
+		view_x -= sign_width;
+	}
+	transition_finish(t, view_x);
+}
+
+/* One step; false after the last. */
+static bool transition_step(transition_t* const t) {
+	switch( t->type ) {
+	case TRANSITION_WIPE_RIGHT:
+	case TRANSITION_WIPE_LEFT:
+		for(uint8_t i=0; (i<t->step) && (t->position<sign_width); i++, t->position++) {
+			const uint8_t x = (t->type == TRANSITION_WIPE_RIGHT) ? t->position : (sign_width - 1 - t->position);
+			for(uint8_t y=0; y<sign_height; y++) {
+				transition_copy_pixel(t, x, y);
+			}
+		}
+		return t->position < sign_width;
+
+	case TRANSITION_DISSOLVE:
+		/* position is the LFSR state; it visits 1 to 1023 and then comes
+		 * back to 1. State 0, pixel (0, 0), is done last.
+		 */
+		for(uint8_t i=0; i<t->step; ) {
+			const uint16_t v = t->position;
+			const uint8_t x = v & 0x7F;
+			const uint8_t y = v >> 7;
+			if( (x < sign_width) && (y < sign_height) ) {
+				transition_copy_pixel(t, x, y);
+				i++;
+			}
+			t->position = (v >> 1) ^ ((v & 1) ? dissolve_lfsr_mask : 0);
+			if( t->position == 1 ) {
+				transition_copy_pixel(t, 0, 0);
+				return false;
+			}
+		}
+		return true;
+
+	case TRANSITION_SLIDE_LEFT:
+	case TRANSITION_SLIDE_RIGHT: {
+		/* The two buffers side by side as a canvas, the old on the left
+		 * when sliding left: the viewport moves from one to the other.
+		 */
+		uint8_t n = t->step;
+		if( n > (sign_width - t->position) ) {
+			n = sign_width - t->position;
+		}
+		t->position += n;
+		uint8_t x = pending_view_x;
+		if( t->type == TRANSITION_SLIDE_LEFT ) {
+			x += n;
+			if( x >= canvas_width ) {
+				x -= canvas_width;
+			}
+		} else {
+			x = (x < n) ? (x + canvas_width - n) : (x - n);
+		}
+		pending_view_x = x;
+		return t->position < sign_width;
+	}
+
+	default: {
+		uint8_t map[sign_height];
+		for(uint8_t i=0; (i<t->step) && (t->position<sign_height); i++) {
+			t->position += 1;
+		}
+		for(uint8_t n=0; n<sign_height; n++) {
+			map[n] = n;
+		}
+		for(uint8_t i=0; i<t->position; i++) {
+			map[pgm_read_byte(&blind_order[i])] |= ROW_MAP_OTHER;
+		}
+		row_map_set(map);
+		return t->position < sign_height;
+	}
+	}
+}
+
+bool transition_update(void* const tv) {
+	transition_t* const t = (transition_t* const)tv;
+	if( !t->started ) {
+		if( buffer_swap_pending() ) {
+			/* The hidden buffer is not settled yet. */
+			return true;
+		}
+		t->started = true;
+		t->from = current_buffer;
+		t->to = current_buffer ^ 1;
+		t->position = (t->type == TRANSITION_DISSOLVE) ? 1 : 0;
+		if( (t->type == TRANSITION_SLIDE_LEFT) || (t->type == TRANSITION_SLIDE_RIGHT) ) {
+			const uint8_t sreg = SREG;
+			cli();
+			pending_display_mode = DISPLAY_MODE_CANVAS;
+			if( t->from ) {
+				pending_view_x += sign_width;
+			}
+			SREG = sreg;
+		}
+	}
+
+	if( t->frame_count < t->frames_per_step ) {
+		t->frame_count += 1;
+		return true;
+	}
+	t->frame_count = 0;
+
+	if( transition_step(t) ) {
+		return true;
+	}
+	transition_end(t);
+	return false;
+}
+
+/* Only one animation runs at a time, even under a playlist, so they
+ * share their state. Tell them apart by update_fn, not by state.
+ */
+static union {
+	scroll_h_t scroll_h;
+	scroll_v_t scroll_v;
+	transition_t transition;
+} animation_states;
+
+static scroll_h_t& scroll_h = animation_states.scroll_h;
+static scroll_v_t& scroll_v = animation_states.scroll_v;
+static transition_t& transition = animation_states.transition;
+
+/* Compressed frames, uploaded (usb_set_frame_rle) or in a playlist. A
+ * row mask (bit n set: row n is sent) is followed by a token stream that
+ * fills the selected rows, 15 bytes each, in order. Runs may cross row
+ * boundaries. Each token is an op in the top two bits and a run length of
+ * 1-64 in the low six.
+ */
+typedef enum {
+	RLE_LITERAL = 0x00,	// run length bytes follow
+	RLE_ZEROS = 0x40,
+	RLE_ONES = 0x80,
+	RLE_SKIP = 0xC0,	// leave bytes unchanged
+} rle_op_t;
+
+/* Reads the next 'count' bytes of the token stream. */
+typedef bool (*rle_read_fn)(void* const context, uint8_t* const data, const uint8_t count);
+
+static bool rle_decode(uint8_t (* const frame)[sign_width_bytes], const uint8_t row_mask,
+	const rle_read_fn read, void* const context) {
+	uint8_t op = RLE_LITERAL;
+	uint8_t run = 0;
+	for(uint8_t row=0; row<sign_height; row++) {
+		if( (row_mask & (1 << row)) == 0 ) {
+			continue;
+		}
+
+		uint8_t* const p = frame[row];
+		uint8_t column = 0;
+		while( column < sign_width_bytes ) {
+			if( run == 0 ) {
+				uint8_t token;
+				if( !read(context, &token, 1) ) {
+					return false;
+				}
+				op = token & 0xC0;
+				run = (token & 0x3F) + 1;
+			}
+
+			uint8_t count = sign_width_bytes - column;
+			if( count > run ) {
+				count = run;
+			}
+
+			switch( op ) {
+			case RLE_LITERAL:
+				if( !read(context, &p[column], count) ) {
+					return false;
+				}
+				break;
+
+			case RLE_ZEROS:
+			case RLE_ONES:
+				{
+					const uint8_t value = (op == RLE_ONES) ? 0xFF : 0x00;
+					for(uint8_t i=0; i<count; i++) {
+						p[column + i] = value;
+					}
+				}
+				break;
+
+			default:
+				break;
+			}
+
+			column += count;
+			run -= count;
+		}
+	}
+
+	return (run == 0);
+}
+
+static bool usb_rle_read(void* const, uint8_t* const data, const uint8_t count) {
+	return usb_command_recv(data, count);
+}
+
+/* Playlists: a program kept in EEPROM that animate() steps through once a
+ * frame, so an attract loop runs with frame-exact timing and no host
+ * traffic. Instructions are an opcode and its operand bytes:
+ *
+ *   PLAY_END                      stop
+ *   PLAY_CLEAR                    clear the hidden buffer
+ *   PLAY_TEXT x, y | font << 4, n, n characters
+ *                                 draw text into the hidden buffer
+ *   PLAY_SHOW                     show the hidden buffer next frame
+ *   PLAY_WAIT frames              go on that many frames later
+ *   PLAY_SCROLL_LEFT/RIGHT frames_per_pixel, pixels
+ *                                 scroll the sign and wait for it
+ *   PLAY_REPEAT count ... PLAY_NEXT
+ *                                 run the instructions between count
+ *                                 times (0 is once); no nesting
+ *   PLAY_JUMP address             continue at the byte address
+ *   PLAY_FRAME row_mask, tokens   load a compressed frame (see rle_decode)
+ *                                 into the hidden buffer
+ *   PLAY_TRANSITION type, frames_per_step, step
+ *                                 show the hidden buffer with a
+ *                                 transition and wait for it
+ *
+ * Any other byte, including erased EEPROM (0xFF), stops the playlist.
+ * Instructions that take no frames run on until one that does, at most
+ * playlist_steps_per_frame a frame, so a loop without a PLAY_SHOW or
+ * PLAY_WAIT cannot hold up the commands from the host. Playlists are for
+ * mono mode: the hidden buffer is the one not on show.
+ */
+typedef enum {
+	PLAY_END = 0,
+	PLAY_CLEAR = 1,
+	PLAY_TEXT = 2,
+	PLAY_SHOW = 3,
+	PLAY_WAIT = 4,
+	PLAY_SCROLL_LEFT = 5,
+	PLAY_SCROLL_RIGHT = 6,
+	PLAY_REPEAT = 7,
+	PLAY_NEXT = 8,
+	PLAY_JUMP = 9,
+	PLAY_FRAME = 10,
+	PLAY_TRANSITION = 11,
+} play_op_t;
+
+static const uint8_t playlist_size = 208;
+static const uint8_t playlist_steps_per_frame = 8;
+
+EEMEM uint8_t playlist[playlist_size] = { PLAY_END };
+
+/* 1: run the playlist at power-on (see playlist_boot_start). Erased
+ * EEPROM reads 0xFF, so a new chip does not.
+ */
+EEMEM uint8_t playlist_boot = 0;
+
+typedef struct {
+	uint8_t pc;
+	uint8_t wait;
+	uint8_t repeat_pc;
+	uint8_t repeat_count;
+	animation_t running;
+} playlist_run_t;
+
+void playlist_init(void* const pv) {
+	playlist_run_t* const p = (playlist_run_t* const)pv;
+	p->pc = 0;
+	p->wait = 0;
+	p->repeat_pc = 0;
+	p->repeat_count = 0;
+	p->running.state = 0;
+	p->running.update_fn = 0;
+}
+
+static uint8_t playlist_fetch(playlist_run_t* const p) {
+	if( p->pc >= playlist_size ) {
+		return PLAY_END;
+	}
+	return eeprom_read_byte(&playlist[p->pc++]);
+}
+
+static bool playlist_rle_read(void* const pv, uint8_t* const data, const uint8_t count) {
+	playlist_run_t* const p = (playlist_run_t* const)pv;
+	for(uint8_t i=0; i<count; i++) {
+		data[i] = playlist_fetch(p);
+	}
+	return true;
+}
+
+static void playlist_clear(const uint8_t buffer) {
+	uint8_t* rp = &data_r[buffer][0][0];
+	for(uint8_t i=0; i<sizeof(data_r[0]); i++) {
+		*(rp++) = 0;
+	}
+}
+
+bool playlist_update(void* const pv) {
+	playlist_run_t* const p = (playlist_run_t* const)pv;
+	if( p->running.update_fn ) {
+		if( p->running.update_fn(p->running.state) ) {
+			return true;
+		}
+		p->running.update_fn = 0;
+		p->running.state = 0;
+	}
+	if( p->wait ) {
+		p->wait -= 1;
+		if( p->wait ) {
+			return true;
+		}
+	}
+
+	for(uint8_t step=0; step<playlist_steps_per_frame; step++) {
+		const uint8_t hidden = current_buffer ^ 1;
+		const uint8_t op = playlist_fetch(p);
+		switch( op ) {
+		case PLAY_CLEAR:
+			playlist_clear(hidden);
+			break;
+
+		case PLAY_TEXT: {
+			uint8_t x = playlist_fetch(p);
+			const uint8_t y_font = playlist_fetch(p);
+			uint8_t n = playlist_fetch(p);
+			const uint8_t font = y_font >> 4;
+			if( font >= FONT_COUNT ) {
+				return false;
+			}
+			for(; n>0; n--) {
+				const uint8_t c = playlist_fetch(p);
+				if( x < sign_width ) {
+					x += draw_char(data_r[hidden][0], x, y_font & 0x0F, font, c, 1);
+				}
+			}
+			break;
+		}
+
+		case PLAY_SHOW:
+			pending_buffer = hidden;
+			return true;
+
+		case PLAY_WAIT:
+			p->wait = playlist_fetch(p);
+			if( p->wait ) {
+				return true;
+			}
+			break;
+
+		case PLAY_SCROLL_LEFT:
+		case PLAY_SCROLL_RIGHT: {
+			const uint8_t frames_per_pixel = playlist_fetch(p);
+			const uint8_t pixels = playlist_fetch(p);
+			scroll_h_init(&scroll_h, frames_per_pixel, pixels, false, 0, sign_width, 0, sign_height);
+			p->running.state = &scroll_h;
+			p->running.update_fn = (op == PLAY_SCROLL_LEFT) ? scroll_left_update : scroll_right_update;
+			return true;
+		}
+
+		case PLAY_TRANSITION: {
+			const uint8_t type = playlist_fetch(p);
+			const uint8_t frames_per_step = playlist_fetch(p);
+			const uint8_t step = playlist_fetch(p);
+			if( type >= TRANSITION_COUNT ) {
+				return false;
+			}
+			transition_init(&transition, type, frames_per_step, step);
+			p->running.state = &transition;
+			p->running.update_fn = transition_update;
+			return true;
+		}
+
+		case PLAY_REPEAT:
+			p->repeat_count = playlist_fetch(p);
+			p->repeat_pc = p->pc;
+			break;
+
+		case PLAY_NEXT:
+			if( p->repeat_count > 1 ) {
+				p->repeat_count -= 1;
+				p->pc = p->repeat_pc;
+			}
+			break;
+
+		case PLAY_JUMP:
+			p->pc = playlist_fetch(p);
+			break;
+
+		case PLAY_FRAME: {
+			const uint8_t row_mask = playlist_fetch(p);
+			rle_decode(data_r[hidden], row_mask, playlist_rle_read, p);
+			break;
+		}
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+playlist_run_t playlist_run;
+
+static void playlist_start() {
+	playlist_init(&playlist_run);
+	animation.state = &playlist_run;
+	animation.update_fn = playlist_update;
+}
+
+/* Called once the refresh is running, before USB has enumerated (or
+ * even if it never does). The first step is run at once, so the first
+ * picture is drawn and queued for the next frame boundary: on the sign
+ * within one frame of reset.
+ */
+static void playlist_boot_start() {
+	if( eeprom_read_byte(&playlist_boot) == 1 ) {
+		playlist_start();
+		if( !playlist_update(&playlist_run) ) {
+			animation.update_fn = 0;
+			animation.state = 0;
+		}
+	}
+}
+
+/* Events reported on the interrupt IN endpoint. The host arms a mask of
+ * events with the notify request; the next frame on which one of them
+ * happens sends a single report and disarms. ANIMATION_DONE is reported on
+ * any frame with no animation running, so arming it after a short
+ * animation has already finished still returns at the next frame.
+ */
+typedef enum {
+	EVENT_FRAME_SYNC = 0x01,
+	EVENT_ANIMATION_DONE = 0x02,
+} event_t;
+
+typedef struct {
+	uint8_t events;
+	uint8_t buffer;
+	uint16_t frame_count;
+	uint8_t stack_unused;
+} event_report_t;
+
+static volatile uint8_t event_mask = 0;
+
+/* Stack paint. At reset, before the C runtime sets the stack pointer, the
+ * SRAM between the static data (_end) and the top of RAM is filled with
+ * stack_paint_byte. The stack grows down into it, so the bytes above _end
+ * still holding the paint are ones it has never reached; stack_unused()
+ * counts them for the event report.
+ */
+extern uint8_t _end;
+static const uint8_t stack_paint_byte = 0xC5;
+
+void stack_paint() __attribute__((naked, used, section(".init1")));
+void stack_paint() {
+	/* Asm: r1 is not cleared yet, so compiled code could not rely on it. */
+	__asm__ volatile(
+		"ldi r30, lo8(_end)\n\t"
+		"ldi r31, hi8(_end)\n\t"
+		"ldi r24, %[paint]\n\t"
+		"ldi r25, hi8(__stack + 1)\n"
+		"1:\n\t"
+		"st Z+, r24\n\t"
+		"cpi r30, lo8(__stack + 1)\n\t"
+		"cpc r31, r25\n\t"
+		"brlo 1b\n\t"
+		:
+		: [paint] "i" (stack_paint_byte)
+	);
+}
+
+static uint8_t stack_unused() {
+	const uint8_t* p = &_end;
+	uint8_t count = 0;
+	while( (*p == stack_paint_byte) && (count < 0xFF) ) {
+		p++;
+		count++;
+	}
+	return count;
+}
+
+void report_events(const uint8_t events) {
+	if( events & event_mask ) {
+		const event_report_t report = {
+			events, current_buffer, frame_count, stack_unused()
+		};
+		if( usb_send_event(&report, sizeof(report)) ) {
+			event_mask = 0;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+/* Plane n of buffer b is stored in buffer b + n, so plane 1 of buffer 0
+ * is the weight 2 plane of a grayscale frame.
+ */
+bool usb_set_line(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.bRequest;
+	const uint16_t length = usb_command_length();
+	if( (buffer < 2) && (length >= 2) && (length <= (2 + sign_width_bytes)) ) {
+		uint8_t header[2];
+		if( usb_command_recv(header, sizeof(header)) ) {
+			const uint8_t plane = header[0];
+			const uint8_t row = header[1];
+			if( ((buffer + plane) < 2) && (row < sign_height) ) {
+				return usb_command_recv(&data_r[buffer + plane][row], length - 2);
+			}
+		}
+	}
+
+	return false;
+}
+
+bool usb_set_frame(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+	if( (buffer < 2) && (usb_command_length() == sizeof(data_r[buffer])) ) {
+		return usb_command_recv(&data_r[buffer], sizeof(data_r[buffer]));
+	}
+
+	return false;
+}
+
+/* See rle_decode() for the format. */
+bool usb_set_frame_rle(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+	uint8_t row_mask;
+	if( (buffer >= 2) || !usb_command_recv(&row_mask, 1) ) {
+		return false;
+	}
+
+	return rle_decode(data_r[buffer], row_mask, usb_rle_read, 0) && (usb_command_length() == 0);
+}
+
+
+bool usb_show_buffer(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+	const bool wait = setup.wIndex_L & usb_request_wait;
+	if( (buffer == 0) || (buffer == 1) ) {
+		pending_buffer = buffer;
+		if( wait ) {
+			while( buffer_swap_pending() );
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool usb_clear_buffer(const uint8_t buffer) {
+	if( buffer < 2 ) {
+		uint8_t* rp = (uint8_t*)&data_r[buffer];
+		for(uint8_t i=0; i<sizeof(data_r[buffer]); i++) {
+			*(rp++) = 0;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/* Characters are drawn as they come out of the command ring, so the
+ * message length is limited only by wLength.
+ *
+ * The low nibble of wValue_H is the colour: 0 draws into the buffer alone,
+ * as in mono mode. Otherwise the buffer must be 0 and bit 0 (red) and bit 1
+ * (green) select which planes get the glyph; the other plane has the glyph
+ * cell cleared, so 1 is red, 2 green and 3 yellow. The high nibble is the
+ * font.
+ *
+ * Buffer 2 is the canvas (see DISPLAY_MODE_CANVAS): x runs to 239, and
+ * the colour must be 0.
+ */
+bool usb_draw_text(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+	const uint8_t colour = setup.wValue_H & 0x0F;
+	const uint8_t font = setup.wValue_H >> 4;
+	uint8_t position[2];
+	if( (buffer > canvas_buffer) || (colour > 3) || ((colour != 0) && (buffer != 0)) ||
+		(font >= FONT_COUNT) ||
+		!usb_command_recv(position, sizeof(position)) ) {
+		return false;
+	}
+
+	uint8_t x = position[0];
+	const uint8_t y = position[1];
+	while( usb_command_length() > 0 ) {
+		char c;
+		if( !usb_command_recv(&c, 1) ) {
+			return false;
+		}
+		if( buffer == canvas_buffer ) {
+			if( x < canvas_width ) {
+				x += draw_char_canvas(x, y, font, c);
+			}
+		} else if( x < sign_width ) {
+			if( colour == 0 ) {
+				x += draw_char(data_r[buffer][0], x, y, font, c, 1);
+			} else {
+				draw_char(data_g[0], x, y, font, c, colour >> 1);
+				x += draw_char(data_r[0][0], x, y, font, c, colour & 1);
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Sprites are packed into one SRAM pool, each starting where the one
+ * before it ends, MSB-first rows of (width + 7) / 8 bytes like the glyphs.
+ * Loading sprite n discards sprites above n, so load them in order.
+ */
+typedef struct {
+	uint8_t offset;
+	uint8_t width;
+	uint8_t height;
+} sprite_t;
+
+static const uint8_t sprite_count = 4;
+static const uint8_t sprite_pool_size = 32;
+
+static uint8_t sprite_pool[sprite_pool_size];
+static sprite_t sprite[sprite_count];
+
+static uint16_t sprite_size(const uint8_t width, const uint8_t height) {
+	return ((width + 7) >> 3) * height;
+}
+
+static uint16_t sprite_end(const sprite_t& s) {
+	return s.offset + sprite_size(s.width, s.height);
+}
+
+/* wValue_L is the sprite number. The data stage is width, height and the
+ * sprite rows.
+ */
+bool usb_load_sprite(const usb_setup_t& setup) {
+	const uint8_t n = setup.wValue_L;
+	uint8_t size[2];
+	if( (n >= sprite_count) || !usb_command_recv(size, sizeof(size)) ) {
+		return false;
+	}
+
+	const uint8_t width = size[0];
+	const uint8_t height = size[1];
+	if( (n > 0) && (sprite[n - 1].height == 0) ) {
+		return false;
+	}
+	const uint16_t offset = (n == 0) ? 0 : sprite_end(sprite[n - 1]);
+	const uint16_t length = sprite_size(width, height);
+	if( (width == 0) || (height == 0) || (height > sign_height) ||
+		(usb_command_length() != length) || ((offset + length) > sprite_pool_size) ) {
+		return false;
+	}
+
+	for(uint8_t i=n; i<sprite_count; i++) {
+		sprite[i].height = 0;
+	}
+	if( !usb_command_recv(&sprite_pool[offset], length) ) {
+		return false;
+	}
+	sprite[n].offset = offset;
+	sprite[n].width = width;
+	sprite[n].height = height;
+	return true;
+}
+
+typedef struct {
+	uint8_t sprite;
+	uint8_t op;	/* blit_op_t */
+	uint8_t x;
+	uint8_t y;
+} usb_draw_sprite_t;
+
+bool usb_draw_sprite(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+
+	usb_draw_sprite_t data;
+	if( (usb_command_length() != sizeof(data)) || !usb_command_recv(&data, sizeof(data)) ) {
+		return false;
+	}
+
+	if( (buffer < 2) && (data.sprite < sprite_count) && (data.op <= BLIT_CLEAR) ) {
+		const sprite_t& s = sprite[data.sprite];
+		if( s.height == 0 ) {
+			return false;
+		}
+		blit(
+			&sprite_pool[s.offset], (s.width + 7) >> 3, BLIT_SOURCE_RAM,
+			0, s.width, s.height,
+			data_r[buffer][0],
+			data.x, data.y, (blit_op_t)data.op
+		);
+		return true;
+	}
+
+	return false;
+}
+
+/* Replaces FONT_USER. wValue_L is the first character; the data stage is
+ * its glyphs, 8 bytes each (see user_font_t), up to 8 pixels wide.
+ * EEPROM writes take ~3.4ms a byte, so a full font holds up the command
+ * queue for over a second; refresh carries on.
+ */
+bool usb_load_font(const usb_setup_t& setup) {
+	const uint8_t first = setup.wValue_L;
+	const uint16_t length = usb_command_length();
+	const uint8_t count = length / user_font_glyph_size;
+	if( (length % user_font_glyph_size) || (count > user_font_glyphs) ) {
+		return false;
+	}
+
+	eeprom_update_byte(&user_font.count, 0);
+	for(uint8_t i=0; i<count; i++) {
+		uint8_t glyph[user_font_glyph_size];
+		if( !usb_command_recv(glyph, sizeof(glyph)) || ((glyph[0] & 0x0F) > 8) ) {
+			return false;
+		}
+		eeprom_update_block(glyph, user_font.glyph[i], sizeof(glyph));
+	}
+	eeprom_update_byte(&user_font.first, first);
+	eeprom_update_byte(&user_font.count, count);
+	return true;
+}
+
+/* wValue_H 1: loop until stopped (see usb_stop_animation). The data may
+ * go on with a column range, x1 and x2 (exclusive), and then a row range,
+ * y1 and y2, to scroll only that window.
+ */
+typedef struct {
+	uint8_t frames_per_pixel;
+	uint8_t pixel_count;
+	uint8_t x1;
+	uint8_t x2;
+	uint8_t y1;
+	uint8_t y2;
+} usb_animate_scroll_t;
+
+static bool usb_recv_scroll(usb_animate_scroll_t* const data) {
+	const uint16_t length = usb_command_length();
+	data->x1 = 0;
+	data->x2 = sign_width;
+	data->y1 = 0;
+	data->y2 = sign_height;
+	if( ((length != 2) && (length != 4) && (length != 6)) || !usb_command_recv(data, length) ) {
+		return false;
+	}
+	return (data->x1 < data->x2) && (data->x2 <= sign_width) &&
+		(data->y1 < data->y2) && (data->y2 <= sign_height);
+}
 
 bool usb_animate_scroll_left(const usb_setup_t& setup) {
 	const uint8_t buffer = setup.wValue_L;
-	uint8_t length = setup.wLength_L;
+	const bool loop = (setup.wValue_H & 1);
 
-	usb_animate_scroll_h_t data;
-	USB_RecvControl(&data, length);
+	usb_animate_scroll_t data;
+	if( !usb_recv_scroll(&data) ) {
+		return false;
+	}
 
 	if( buffer < 2 ) {
 		if( animation.update_fn == 0 ) {
-			scroll_h_init(&scroll_h, data.frames_per_pixel, data.pixel_count);
+			scroll_h_init(&scroll_h, data.frames_per_pixel, data.pixel_count, loop,
+				data.x1, data.x2, data.y1, data.y2);
 			animation.state = &scroll_h;
 			animation.update_fn = scroll_left_update;
 		}
@@ -744,14 +2437,17 @@ bool usb_animate_scroll_left(const usb_setup_t& setup) {
 
 bool usb_animate_scroll_right(const usb_setup_t& setup) {
 	const uint8_t buffer = setup.wValue_L;
-	uint8_t length = setup.wLength_L;
+	const bool loop = (setup.wValue_H & 1);
 
-	usb_animate_scroll_h_t data;
-	USB_RecvControl(&data, length);
+	usb_animate_scroll_t data;
+	if( !usb_recv_scroll(&data) ) {
+		return false;
+	}
 
 	if( buffer < 2 ) {
 		if( animation.update_fn == 0 ) {
-			scroll_h_init(&scroll_h, data.frames_per_pixel, data.pixel_count);
+			scroll_h_init(&scroll_h, data.frames_per_pixel, data.pixel_count, loop,
+				data.x1, data.x2, data.y1, data.y2);
 			animation.state = &scroll_h;
 			animation.update_fn = scroll_right_update;
 		}
@@ -762,6 +2458,298 @@ bool usb_animate_scroll_right(const usb_setup_t& setup) {
 	return false;
 }
 
+/* The data is as for the horizontal scrolls, in rows: frames per row and
+ * a row count, then optionally a row range (after a column range, which
+ * must be the full width). wValue_H 1: roll in the other buffer rather
+ * than wrap; the row count is then always 7, and there may be no range.
+ */
+bool usb_animate_scroll_v(const usb_setup_t& setup, const bool up) {
+	const uint8_t buffer = setup.wValue_L;
+	const bool roll = (setup.wValue_H & 1);
+
+	usb_animate_scroll_t data;
+	if( !usb_recv_scroll(&data) || (data.x1 != 0) || (data.x2 != sign_width) ) {
+		return false;
+	}
+	if( roll && ((data.y1 != 0) || (data.y2 != sign_height)) ) {
+		return false;
+	}
+
+	/* Fails if an animation is running: the host would take a roll's
+	 * buffer swap for granted.
+	 */
+	if( (buffer < 2) && (animation.update_fn == 0) ) {
+		scroll_v_init(&scroll_v, data.frames_per_pixel, data.pixel_count, up, roll,
+			data.y1, data.y2);
+		animation.state = &scroll_v;
+		animation.update_fn = scroll_v_update;
+		return true;
+	}
+
+	return false;
+}
+
+/* Seven map entries (see refresh_row_map). */
+bool usb_set_row_map(const usb_setup_t& setup) {
+	uint8_t map[sign_height];
+	if( (usb_command_length() != sizeof(map)) || !usb_command_recv(map, sizeof(map)) ) {
+		return false;
+	}
+
+	for(uint8_t i=0; i<sign_height; i++) {
+		if( (map[i] & ~ROW_MAP_OTHER) >= sign_height ) {
+			return false;
+		}
+	}
+	row_map_set(map);
+	return true;
+}
+
+typedef struct {
+	uint8_t buffer;
+	uint8_t offset;
+	bool flip;
+} bulk_frame_t;
+
+static volatile bulk_frame_t bulk_frame = {
+	0, 0, false
+};
+
+bool usb_set_bulk_target(const usb_setup_t& setup) {
+	const uint8_t buffer = setup.wValue_L;
+	const uint8_t flags = setup.wValue_H;
+	if( buffer < 2 ) {
+		bulk_frame.buffer = buffer;
+		bulk_frame.offset = 0;
+		bulk_frame.flip = (flags & 1);
+		return true;
+	}
+
+	return false;
+}
+
+/* In flip mode a completed frame is queued for display, and the next one
+ * goes to the buffer still on screen until the swap happens. Stop reading
+ * until then; the data stays in the endpoint FIFO and the host is NAKed.
+ */
+void usb_handle_bulk_out(const uint8_t count) {
+	uint8_t remaining = count;
+	while( remaining > 0 ) {
+		if( bulk_frame.flip && (bulk_frame.offset == 0) && buffer_swap_pending() ) {
+			return;
+		}
+
+		uint8_t length = sizeof(data_r[0]) - bulk_frame.offset;
+		if( length > remaining ) {
+			length = remaining;
+		}
+		uint8_t* const p = refresh_row_start(bulk_frame.buffer, 0);
+		Recv(&p[bulk_frame.offset], length);
+		remaining -= length;
+		bulk_frame.offset += length;
+
+		if( bulk_frame.offset >= sizeof(data_r[0]) ) {
+			bulk_frame.offset = 0;
+			if( bulk_frame.flip ) {
+				pending_buffer = bulk_frame.buffer;
+				bulk_frame.buffer ^= 1;
+			}
+		}
+	}
+}
+
+bool usb_notify(const usb_setup_t& setup) {
+	usb_reset_event_endpoint();
+	event_mask = setup.wValue_L;
+	return true;
+}
+
+/* Frame rate in Hz, in wValue. */
+bool usb_set_frame_rate(const usb_setup_t& setup) {
+	const uint16_t rate = (setup.wValue_H << 8) | setup.wValue_L;
+	if( (rate >= refresh_rate_min) && (rate <= refresh_rate_max) ) {
+		refresh_rate = rate;
+		refresh_configure_timing();
+		return true;
+	}
+
+	return false;
+}
+
+/* Viewport offset in wValue_L, 0-119 (0-239 in canvas mode): the column
+ * shown at the left edge.
+ */
+bool usb_set_viewport(const usb_setup_t& setup) {
+	const uint8_t x = setup.wValue_L;
+	if( x < view_width() ) {
+		pending_view_x = x;
+		return true;
+	}
+
+	return false;
+}
+
+/* Brightness in wValue_L: 255 is full on, 0 off. */
+bool usb_set_brightness(const usb_setup_t& setup) {
+	refresh_brightness = setup.wValue_L;
+	refresh_configure_timing();
+	return true;
+}
+
+/* wValue_L: mode. wValue_H: in layered mode, the layer op. */
+bool usb_set_display_mode(const usb_setup_t& setup) {
+	const uint8_t mode = setup.wValue_L;
+	const uint8_t op = setup.wValue_H;
+	if( op > BLIT_CLEAR ) {
+		return false;
+	}
+#if defined(BICOLOR)
+	if( mode <= DISPLAY_MODE_LAYERED ) {
+#else
+	if( (mode <= DISPLAY_MODE_LAYERED) && (mode != DISPLAY_MODE_BICOLOR) ) {
+#endif
+		const uint8_t sreg = SREG;
+		cli();
+		pending_display_mode = (display_mode_t)mode;
+		if( mode == DISPLAY_MODE_LAYERED ) {
+			pending_layer_op = (blit_op_t)op;
+		}
+		if( pending_view_x >= view_width() ) {
+			pending_view_x -= sign_width;
+		}
+		SREG = sreg;
+		return true;
+	}
+
+	return false;
+}
+
+/* wValue_L: transition type (see transition_update). The data is frames
+ * per step and the step: columns, pixels or rows, at most 12 columns for
+ * a wipe and 64 pixels for a dissolve. Fails if an animation is running.
+ */
+typedef struct {
+	uint8_t frames_per_step;
+	uint8_t step;
+} usb_transition_t;
+
+bool usb_transition(const usb_setup_t& setup) {
+	const uint8_t type = setup.wValue_L;
+	usb_transition_t data;
+	if( (type >= TRANSITION_COUNT) ||
+		(usb_command_length() != sizeof(data)) ||
+		!usb_command_recv(&data, sizeof(data)) ) {
+		return false;
+	}
+
+	if( animation.update_fn == 0 ) {
+		transition_init(&transition, type, data.frames_per_step, data.step);
+		animation.state = &transition;
+		animation.update_fn = transition_update;
+		return true;
+	}
+	return false;
+}
+
+/* Stores a playlist (see playlist_update) in EEPROM, up to 208 bytes; a
+ * running playlist is stopped first. Slow, like usb_load_font.
+ */
+bool usb_load_playlist(const usb_setup_t&) {
+	const uint16_t length = usb_command_length();
+	if( length > playlist_size ) {
+		return false;
+	}
+	if( animation.state == &playlist_run ) {
+		animation.update_fn = 0;
+		animation.state = 0;
+	}
+
+	uint8_t address = 0;
+	while( usb_command_length() > 0 ) {
+		uint8_t chunk[8];
+		uint8_t n = sizeof(chunk);
+		if( usb_command_length() < n ) {
+			n = usb_command_length();
+		}
+		if( !usb_command_recv(chunk, n) ) {
+			return false;
+		}
+		eeprom_update_block(chunk, &playlist[address], n);
+		address += n;
+	}
+	if( address < playlist_size ) {
+		eeprom_update_byte(&playlist[address], PLAY_END);
+	}
+	return true;
+}
+
+/* Runs the stored playlist from the start. Fails if an animation is
+ * running; stop it first.
+ */
+bool usb_play_playlist(const usb_setup_t&) {
+	if( animation.update_fn != 0 ) {
+		return false;
+	}
+	playlist_start();
+	return true;
+}
+
+/* wValue_L 1: run the stored playlist at power-on, without waiting for a
+ * host; 0: start dark, as before.
+ */
+bool usb_set_boot_playlist(const usb_setup_t& setup) {
+	const uint8_t boot = setup.wValue_L;
+	if( boot > 1 ) {
+		return false;
+	}
+	eeprom_update_byte(&playlist_boot, boot);
+	return true;
+}
+
+/* Stops the running animation where it is: the viewport and row map keep
+ * their current values. A window scroll puts the buffer it started on
+ * back on show; a transition skips to its end. Either way the animation
+ * is gone when this returns, so the next command may start another.
+ */
+bool usb_stop_animation(const usb_setup_t&) {
+	bool (* const fn)(void* const) = (animation.update_fn == playlist_update) ?
+		playlist_run.running.update_fn : animation.update_fn;
+	if( fn == transition_update ) {
+		transition_end(&transition);
+	} else if( (fn == scroll_left_update) || (fn == scroll_right_update) ) {
+		scroll_h_stop(&scroll_h);
+	}
+	animation.update_fn = 0;
+	animation.state = 0;
+	return true;
+}
+
+/* A batch is a list of commands, each a 4-byte header (bRequest, wValue_L,
+ * wValue_H, data length) followed by its data. They run in order, through
+ * the same handlers as the stand-alone requests, and inherit the batch's
+ * wIndex. Batches do not nest.
+ *
+ * run_command() runs them itself, rather than from a batch handler, so a
+ * command in a batch takes no more stack than one sent on its own.
+ */
+static const uint8_t usb_batch_request = 10;
+
+/* Turns 'setup' into the next command of the batch, and limits reads to
+ * its data.
+ */
+static __attribute__((noinline)) bool usb_batch_next(usb_setup_t& setup) {
+	uint8_t header[4];
+	if( !usb_command_recv(header, sizeof(header)) || (header[0] == usb_batch_request) ) {
+		return false;
+	}
+	setup.bRequest = header[0];
+	setup.wValue_L = header[1];
+	setup.wValue_H = header[2];
+	setup.wLength_L = header[3];
+	setup.wLength_H = 0;
+	return usb_begin_command_window(setup.wLength_L);
+}
+
 bool usb_handle_vendor_request(const usb_setup_t& setup) {
 	switch( setup.bRequest ) {
 	case 0:
@@ -769,7 +2757,7 @@ bool usb_handle_vendor_request(const usb_setup_t& setup) {
 		return usb_set_line(setup);
 
 	case 2:
-		return usb_show_buffer(setup.wValue_L);
+		return usb_show_buffer(setup);
 
 	case 3:
 		return usb_clear_buffer(setup.wValue_L);
@@ -783,24 +2771,130 @@ bool usb_handle_vendor_request(const usb_setup_t& setup) {
 	case 6:
 		return usb_animate_scroll_right(setup);
 
+	case 7:
+		return usb_set_bulk_target(setup);
+
+	case 8:
+		return usb_set_frame(setup);
+
+	case 9:
+		return usb_set_frame_rle(setup);
+
+	case 11:
+		return usb_notify(setup);
+
+	case 12:
+		return usb_set_display_mode(setup);
+
+	case 13:
+		return usb_set_frame_rate(setup);
+
+	case 14:
+		return usb_set_brightness(setup);
+
+	case 15:
+		return usb_load_sprite(setup);
+
+	case 16:
+		return usb_draw_sprite(setup);
+
+	case 17:
+		return usb_load_font(setup);
+
+	case 18:
+		return usb_set_viewport(setup);
+
+	case 19:
+		return usb_animate_scroll_v(setup, true);
+
+	case 20:
+		return usb_animate_scroll_v(setup, false);
+
+	case 21:
+		return usb_set_row_map(setup);
+
+	case 22:
+		return usb_stop_animation(setup);
+
+	case 23:
+		return usb_load_playlist(setup);
+
+	case 24:
+		return usb_play_playlist(setup);
+
+	case 25:
+		return usb_set_boot_playlist(setup);
+
+	case 26:
+		return usb_transition(setup);
+
 	default:
 		return false;
 	}
 }
 
+void run_command() {
+	usb_setup_t setup;
+	if( usb_command_begin(&setup) ) {
+		bool result;
+		if( setup.bRequest == usb_batch_request ) {
+			result = true;
+			while( result && (usb_command_length() > 0) ) {
+				result = usb_batch_next(setup) && usb_handle_vendor_request(setup);
+				result = usb_end_command_window() && result;
+			}
+		} else {
+			result = usb_handle_vendor_request(setup);
+		}
+		usb_command_end(result);
+	}
+}
+
 void animate() {
-	while( frame_sync != true );
+	while( frame_sync != true ) {
+		run_command();
+	}
 	frame_sync = false;
 
+	if( !buffer_swap_pending() ) {
+		usb_resume_bulk_out();
+	}
+
+	uint8_t events = EVENT_FRAME_SYNC;
+
 	if( animation.update_fn != 0 ) {
 		if( animation.update_fn(animation.state) == false ) {
 			animation.update_fn = 0;
 			animation.state = 0;
 		}
 	}
+
+	if( animation.update_fn == 0 ) {
+		events |= EVENT_ANIMATION_DONE;
+	}
+
+	report_events(events);
 }
 
-int main() {
+/* SRAM budget. The at90usb162 has 512 bytes for static data and the
+ * stack together. The worst stack depth is about 128 bytes (main loop
+ * through usb_draw_text and blit, plus the USB interrupt); the remaining
+ * static data, usb.cpp's and the small variables here, is under 96.
+ * stack_unused() in the event report gives what is left on hardware.
+ */
+static const uint16_t sram_size = 512;
+static const uint16_t sram_stack_reserve = 128;
+static const uint16_t sram_other_static = 96;
+
+static_assert(
+	sizeof(data_r) + sizeof(sprite_pool) + sizeof(sprite) +
+	sizeof(animation_states) + sizeof(refresh_slot) + sizeof(playlist_run) +
+	sram_other_static + sram_stack_reserve <= sram_size,
+	"static data leaves too little SRAM for the stack"
+);
+
+/* OS_main: main never returns, so it need not save registers. */
+__attribute__((OS_main)) int main() {
 	while(1) {
 		switch(device_state) {
 		case DEVICE_STATE_UNINITIALIZED:
@@ -809,6 +2903,7 @@ int main() {
 			
 		case DEVICE_STATE_INITIALIZE_HARDWARE:
 			if( configure_hardware() ) {
+				playlist_boot_start();
 				device_state = DEVICE_STATE_FETCH_DATA;
 			} else {
 				device_state = DEVICE_STATE_ERROR;
@@ -67,16 +67,314 @@ void usb_clear_out() {
 	UEINTX &= ~(_BV(RXOUTI) | _BV(FIFOCON));
 }
 
-void usb_wait_for_status_out() {
-	while( !(UEINTX & _BV(RXOUTI)) );
+static void usb_stall_endpoint() {
+	UECONX |= _BV(STALLRQ);
 }
 
-static void usb_wait_for_in_ready() {
-	while( !(UEINTX & _BV(TXINI)) );
+/* Standard requests do not wait in USB_COM_vect for the host either. The
+ * ISR answers the setup, then returns; the stage still to come is left in
+ * usb_stage, and its EP0 interrupt finishes the request. A new setup
+ * cancels it.
+ */
+typedef enum {
+	USB_STAGE_IDLE,
+	USB_STAGE_STATUS_OUT,	/* IN data sent; wait for the host's ZLP */
+	USB_STAGE_SET_ADDRESS,	/* Status ZLP sent; enable the address once it is gone */
+} usb_stage_t;
+
+static usb_stage_t usb_stage = USB_STAGE_IDLE;
+
+static void usb_stage_begin(const usb_stage_t stage) {
+	usb_stage = stage;
+	UEIENX = _BV(RXSTPE) | ((stage == USB_STAGE_STATUS_OUT) ? _BV(RXOUTE) : _BV(TXINE));
 }
 
-static void usb_stall_endpoint() {
-	UECONX |= _BV(STALLRQ);
+static void usb_stage_end() {
+	usb_stage = USB_STAGE_IDLE;
+	UEIENX = _BV(RXSTPE);
+}
+
+/* Vendor requests are not run in USB_COM_vect. The ISR copies each setup
+ * packet and its OUT data stage into this ring, and the main loop runs the
+ * commands from there, between frames. The ISR completes the status stage
+ * as soon as the data is captured, unless the host set usb_request_wait in
+ * wIndex; then usb_command_end() completes it, or stalls, once the command
+ * has run.
+ *
+ * When the ring is full the ISR leaves the packet in the EP0 FIFO and masks
+ * the EP0 interrupt, so the host is NAKed until the main loop makes room.
+ */
+static const uint8_t usb_command_ring_size = 16;
+static const uint8_t usb_command_ring_mask = usb_command_ring_size - 1;
+
+/* A blocked ring is resumed once it has drained to this level, so the
+ * host gets half a ring per resume rather than a byte at a time.
+ */
+static const uint8_t usb_command_resume_level = usb_command_ring_size / 2;
+
+static uint8_t usb_command_ring[usb_command_ring_size];
+static volatile uint8_t usb_command_head = 0;
+static volatile uint8_t usb_command_tail = 0;
+static volatile bool usb_command_blocked = false;
+
+/* ISR side: the transfer being captured. */
+static volatile uint16_t usb_capture_remaining = 0;
+static volatile bool usb_capture_aborted = false;
+static volatile bool usb_status_pending = false;
+static bool usb_capture_wait = false;
+
+/* Main loop side: the command being run. */
+static uint16_t usb_command_remaining = 0;
+static uint16_t usb_command_outside = 0;
+static bool usb_command_wait = false;
+static bool usb_command_truncated = false;
+
+static uint8_t usb_command_used() {
+	return usb_command_head - usb_command_tail;
+}
+
+static void usb_command_push(const uint8_t value) {
+	const uint8_t head = usb_command_head;
+	usb_command_ring[head & usb_command_ring_mask] = value;
+	usb_command_head = head + 1;
+}
+
+static void usb_command_block() {
+	UEIENX = 0;
+	usb_command_blocked = true;
+}
+
+static void usb_capture_end() {
+	UEIENX = _BV(RXSTPE);
+	if( usb_capture_wait ) {
+		usb_status_pending = true;
+	} else {
+		usb_clear_in();
+	}
+}
+
+static void usb_capture_setup(const usb_setup_t& setup) {
+	const uint8_t* p = (const uint8_t*)&setup;
+	for(uint_fast8_t i=0; i<sizeof(setup); i++) {
+		usb_command_push(*(p++));
+	}
+
+	usb_capture_remaining = (setup.wLength_H << 8) | setup.wLength_L;
+	usb_capture_wait = setup.wIndex_L & usb_request_wait;
+	if( usb_capture_remaining == 0 ) {
+		usb_capture_end();
+	} else {
+		UEIENX = _BV(RXSTPE) | _BV(RXOUTE);
+	}
+}
+
+static void usb_capture_data() {
+	while( (UEBCLX > 0) && (usb_capture_remaining > 0) ) {
+		if( usb_command_used() == usb_command_ring_size ) {
+			usb_command_block();
+			return;
+		}
+		usb_command_push(UEDATX);
+		usb_capture_remaining -= 1;
+	}
+
+	/* Anything beyond wLength is dropped. */
+	usb_clear_out();
+	if( usb_capture_remaining == 0 ) {
+		usb_capture_end();
+	}
+}
+
+static void usb_capture_abort() {
+	if( usb_capture_remaining > 0 ) {
+		usb_capture_remaining = 0;
+		usb_capture_aborted = true;
+	}
+	usb_status_pending = false;
+}
+
+static void usb_command_resume() {
+	const uint8_t sreg = SREG;
+	cli();
+	if( usb_command_blocked && !usb_capture_aborted ) {
+		usb_command_blocked = false;
+		const uint8_t endpoint = UENUM;
+		UENUM = 0;
+		UEIENX = _BV(RXSTPE) | ((usb_capture_remaining > 0) ? _BV(RXOUTE) : 0);
+		UENUM = endpoint;
+	}
+	SREG = sreg;
+}
+
+static bool usb_command_pop(uint8_t* const value) {
+	while( usb_command_head == usb_command_tail ) {
+		/* No setup is captured while a truncated transfer is in the
+		 * ring, so an empty ring means no more data is coming.
+		 */
+		if( usb_capture_aborted && (usb_command_head == usb_command_tail) ) {
+			usb_command_truncated = true;
+			return false;
+		}
+	}
+
+	const uint8_t tail = usb_command_tail;
+	*value = usb_command_ring[tail & usb_command_ring_mask];
+	usb_command_tail = tail + 1;
+
+	if( usb_command_blocked && (usb_command_used() <= usb_command_resume_level) ) {
+		usb_command_resume();
+	}
+	return true;
+}
+
+bool usb_command_begin(usb_setup_t* const setup) {
+	if( usb_command_used() < sizeof(usb_setup_t) ) {
+		return false;
+	}
+
+	uint8_t* p = (uint8_t*)setup;
+	for(uint_fast8_t i=0; i<sizeof(usb_setup_t); i++) {
+		usb_command_pop(p++);
+	}
+
+	usb_command_remaining = (setup->wLength_H << 8) | setup->wLength_L;
+	usb_command_outside = 0;
+	usb_command_wait = setup->wIndex_L & usb_request_wait;
+	usb_command_truncated = false;
+	return true;
+}
+
+bool usb_command_recv(void* const data, const uint16_t length) {
+	if( length > usb_command_remaining ) {
+		return false;
+	}
+
+	uint8_t* p = (uint8_t*)data;
+	for(uint16_t i=0; i<length; i++) {
+		uint8_t value;
+		if( !usb_command_pop(&value) ) {
+			usb_command_remaining = 0;
+			usb_command_outside = 0;
+			return false;
+		}
+		if( p ) {
+			*(p++) = value;
+		}
+		usb_command_remaining -= 1;
+	}
+
+	return true;
+}
+
+uint16_t usb_command_length() {
+	return usb_command_remaining;
+}
+
+bool usb_begin_command_window(const uint16_t length) {
+	if( (usb_command_outside != 0) || (length > usb_command_remaining) ) {
+		return false;
+	}
+	usb_command_outside = usb_command_remaining - length;
+	usb_command_remaining = length;
+	return true;
+}
+
+bool usb_end_command_window() {
+	const bool result = usb_command_recv(0, usb_command_remaining);
+	usb_command_remaining = usb_command_outside;
+	usb_command_outside = 0;
+	return result;
+}
+
+void usb_command_end(const bool success) {
+	usb_command_remaining += usb_command_outside;
+	usb_command_outside = 0;
+	usb_command_recv(0, usb_command_remaining);
+
+	if( usb_command_truncated ) {
+		usb_capture_aborted = false;
+		usb_command_resume();
+		return;
+	}
+
+	if( usb_command_wait ) {
+		const uint8_t sreg = SREG;
+		cli();
+		if( usb_status_pending ) {
+			usb_status_pending = false;
+			const uint8_t endpoint = UENUM;
+			UENUM = 0;
+			if( success ) {
+				usb_clear_in();
+			} else {
+				usb_stall_endpoint();
+			}
+			UENUM = endpoint;
+		}
+		SREG = sreg;
+	}
+}
+
+static void usb_configure_endpoints(const uint8_t configuration) {
+	if( configuration == 1 ) {
+		UENUM = usb_bulk_out_endpoint;
+		UECONX = _BV(EPEN);
+		UECFG0X = (2 << EPTYPE0);
+		UECFG1X = (3 << EPSIZE0) | _BV(ALLOC);
+		UEIENX = _BV(RXOUTE);
+
+		UENUM = usb_event_in_endpoint;
+		UECONX = _BV(EPEN);
+		UECFG0X = (3 << EPTYPE0) | _BV(EPDIR);
+		UECFG1X = (0 << EPSIZE0) | _BV(ALLOC);
+		UEIENX = 0;
+	} else {
+		UENUM = usb_event_in_endpoint;
+		UECONX = 0;
+
+		UENUM = usb_bulk_out_endpoint;
+		UEIENX = 0;
+		UECONX = 0;
+	}
+	UENUM = 0;
+}
+
+void usb_resume_bulk_out() {
+	const uint8_t sreg = SREG;
+	cli();
+	if( usb_configuration == 1 ) {
+		const uint8_t endpoint = UENUM;
+		UENUM = usb_bulk_out_endpoint;
+		UEIENX = _BV(RXOUTE);
+		UENUM = endpoint;
+	}
+	SREG = sreg;
+}
+
+bool usb_send_event(const void* const data, const uint8_t length) {
+	bool sent = false;
+
+	const uint8_t sreg = SREG;
+	cli();
+	const uint8_t endpoint = UENUM;
+	UENUM = usb_event_in_endpoint;
+	if( (usb_configuration == 1) && (UEINTX & _BV(TXINI)) ) {
+		const uint8_t* p = (const uint8_t*)data;
+		for(uint_fast8_t i=0; i<length; i++) {
+			UEDATX = *(p++);
+		}
+		usb_clear_in();
+		sent = true;
+	}
+	UENUM = endpoint;
+	SREG = sreg;
+
+	return sent;
+}
+
+void usb_reset_event_endpoint() {
+	UERST = _BV(usb_event_in_endpoint);
+	UERST = 0;
 }
 
 static void usb_write_descriptor(const uint8_t* descriptor, uint8_t descriptor_length, uint8_t requested_length) {
@@ -92,8 +390,7 @@ static void usb_handle_standard_request(const usb_setup_t& setup) {
 			const uint8_t new_address = setup.wValue_L;
 			UDADDR = new_address;
 			usb_clear_in();
-			usb_wait_for_in_ready();
-			UDADDR |= _BV(ADDEN);
+			usb_stage_begin(USB_STAGE_SET_ADDRESS);
 		}
 		break;
 	
@@ -135,8 +432,7 @@ static void usb_handle_standard_request(const usb_setup_t& setup) {
 			if( descriptor ) {
 				usb_write_descriptor(descriptor, descriptor_length, length);
 				usb_clear_in();
-				usb_wait_for_status_out();
-				usb_clear_out();
+				usb_stage_begin(USB_STAGE_STATUS_OUT);
 			} else {
 				usb_stall_endpoint();
 			}
@@ -147,8 +443,7 @@ static void usb_handle_standard_request(const usb_setup_t& setup) {
 		{
 			UEDATX = usb_configuration;
 			usb_clear_in();
-			usb_wait_for_status_out();
-			usb_clear_out();
+			usb_stage_begin(USB_STAGE_STATUS_OUT);
 		}
 		break;
 		
@@ -163,8 +458,8 @@ static void usb_handle_standard_request(const usb_setup_t& setup) {
 					UDADDR = 0;
 				}
 				usb_configuration = new_configuration;
+				usb_configure_endpoints(new_configuration);
 				usb_clear_in();
-				usb_wait_for_in_ready();
 			}
 		}
 		break;
@@ -184,9 +479,30 @@ static void usb_handle_standard_request(const usb_setup_t& setup) {
 }
 
 ISR(USB_COM_vect) {
+	if( UEINT & _BV(usb_bulk_out_endpoint) ) {
+		UENUM = usb_bulk_out_endpoint;
+		if( UEINTX & _BV(RXOUTI) ) {
+			usb_handle_bulk_out(UEBCLX);
+			if( UEBCLX == 0 ) {
+				usb_clear_out();
+			} else {
+				UEIENX = 0;
+			}
+		}
+	}
+
 	UENUM = 0;
 	
 	if( usb_setup_received() ) {
+		usb_capture_abort();
+		if( usb_stage != USB_STAGE_IDLE ) {
+			usb_stage_end();
+		}
+		if( usb_capture_aborted || (usb_command_used() > (usb_command_ring_size - sizeof(usb_setup_t))) ) {
+			usb_command_block();
+			return;
+		}
+
 		usb_setup_t setup;
 		uint8_t* p = (uint8_t*)&setup;
 		
@@ -203,10 +519,10 @@ ISR(USB_COM_vect) {
 			break;
 		
 		case USB_REQUEST_TYPE_VENDOR:
-			if( usb_handle_vendor_request(setup) ) {
-				usb_clear_in();
-			} else {
+			if( setup.bmRequestType & 0x80 ) {
 				usb_stall_endpoint();
+			} else {
+				usb_capture_setup(setup);
 			}
 			break;
 			
@@ -214,8 +530,18 @@ ISR(USB_COM_vect) {
 			usb_stall_endpoint();
 			break;
 		}
-	} else {
-		// TODO: Report error or unexpected event.
+	} else if( usb_stage == USB_STAGE_STATUS_OUT ) {
+		if( UEINTX & _BV(RXOUTI) ) {
+			usb_clear_out();
+			usb_stage_end();
+		}
+	} else if( usb_stage == USB_STAGE_SET_ADDRESS ) {
+		if( UEINTX & _BV(TXINI) ) {
+			UDADDR |= _BV(ADDEN);
+			usb_stage_end();
+		}
+	} else if( UEINTX & _BV(RXOUTI) ) {
+		usb_capture_data();
 	}
 }
 
@@ -225,6 +551,10 @@ ISR(USB_GEN_vect) {
 	
 	if( flags & _BV(EORSTI) ) {
 		usb_configuration = 0;
+		usb_capture_abort();
+		usb_stage = USB_STAGE_IDLE;
+		usb_command_blocked = false;
+		usb_configure_endpoints(0);
 		
 		UENUM = 0;
 		UECONX = _BV(EPEN);
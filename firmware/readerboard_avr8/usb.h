@@ -67,13 +67,58 @@ typedef enum {
 	USB_SYNCH_FRAME = 12,
 } usb_standard_request_t;
 
+/* Endpoint 1 is BULK OUT, 64 bytes, single bank. The at90usb162 DPRAM is
+ * 176 bytes, and endpoint 0 already takes 64 of it.
+ * Endpoint 2 is INTERRUPT IN, 8 bytes, for event reports.
+ */
+static const uint8_t usb_bulk_out_endpoint = 1;
+static const uint8_t usb_bulk_out_size = 64;
+static const uint8_t usb_event_in_endpoint = 2;
+static const uint8_t usb_event_in_size = 8;
+
 void configure_usb();
 void usb_attach();
 //void usb_stall_endpoint();
 
 bool usb_handle_vendor_request(const usb_setup_t& setup);
+void usb_handle_bulk_out(const uint8_t count);
 
 void usb_clear_out();
-void usb_wait_for_status_out();
+
+/* Vendor requests are queued by the USB ISR and run by the main loop.
+ * usb_command_begin() returns the next queued request, if any. Its OUT data
+ * is then read with usb_command_recv(), which waits for data still on its
+ * way from the host; 'data' may be null to discard. usb_command_end()
+ * discards anything not read and, for a request sent with usb_request_wait
+ * in wIndex, completes the status stage (or stalls if 'success' is false).
+ */
+static const uint8_t usb_request_wait = 0x01;
+
+bool usb_command_begin(usb_setup_t* const setup);
+bool usb_command_recv(void* const data, const uint16_t length);
+void usb_command_end(const bool success);
+
+/* Bytes of the current command's data not yet read. */
+uint16_t usb_command_length();
+
+/* Limit reads to the next 'length' bytes, so a command nested in a batch
+ * sees only its own data. Ending the window discards what was not read.
+ * Windows do not nest.
+ */
+bool usb_begin_command_window(const uint16_t length);
+bool usb_end_command_window();
+
+/* usb_handle_bulk_out() may leave data in the FIFO; the endpoint is then
+ * NAKed until the main loop calls usb_resume_bulk_out().
+ */
+void usb_resume_bulk_out();
+
+/* Queue a report on the event endpoint. Safe to call from the main loop.
+ * Returns false if the previous report has not been collected yet.
+ */
+bool usb_send_event(const void* const data, const uint8_t length);
+
+/* Discard a report the host never collected. */
+void usb_reset_event_endpoint();
 
 #endif//__USB_H__
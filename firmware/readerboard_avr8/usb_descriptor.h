@@ -53,7 +53,7 @@ PROGMEM const uint8_t device_descriptor[] = {
 PROGMEM const uint8_t configuration_descriptor[] = {
 	9,
 	USB_DESCRIPTOR_TYPE_CONFIGURATION,
-	18,		// wTotalLength
+	32,		// wTotalLength
 	0,	
 	1,		// bNumInterfaces
 	1,		// bConfigurationValue
@@ -66,19 +66,25 @@ PROGMEM const uint8_t configuration_descriptor[] = {
 	USB_DESCRIPTOR_TYPE_INTERFACE,
 	0,		// bInterfaceNumber
 	0,		// bAlternateSetting
-	0,		// bNumEndpoints
+	2,		// bNumEndpoints
 	0xFF,	// bInterfaceClass
 	0,		// bInterfaceSubClass
 	0xFF,	// bInterfaceProtocol
 	0,		// iInterface
 	
-	/*7,		// bLength
+	7,		// bLength
 	USB_DESCRIPTOR_TYPE_ENDPOINT,
-	0x01,	// bEndpointAddress: OUT, ep #1
+	usb_bulk_out_endpoint,	// bEndpointAddress: OUT, ep #1
 	0x02,	// bmAttributes: BULK
-	0x10,	// wMaxPacketSize: 16
-	0x00,	
-	0,		// bInterval: never NAK*/
+	USB_WORD(usb_bulk_out_size),	// wMaxPacketSize: 64
+	0,		// bInterval: never NAK
+
+	7,		// bLength
+	USB_DESCRIPTOR_TYPE_ENDPOINT,
+	0x80 | usb_event_in_endpoint,	// bEndpointAddress: IN, ep #2
+	0x03,	// bmAttributes: INTERRUPT
+	USB_WORD(usb_event_in_size),	// wMaxPacketSize: 8
+	1,		// bInterval: 1ms
 };
 
 PROGMEM const uint8_t languages_string_descriptor[] = {
@@ -24,9 +24,133 @@ import usb
 import time
 import struct
 import csv
+import contextlib
+
+class Playlist(object):
+    # Builds a program for Readerboard.load_playlist: the device runs it a
+    # frame at a time, drawing into the hidden buffer and showing it, with
+    # no further traffic from the host. Times are in frames.
+    size = 208
+    op_end = 0
+    op_clear = 1
+    op_text = 2
+    op_show = 3
+    op_wait = 4
+    op_scroll_left = 5
+    op_scroll_right = 6
+    op_repeat = 7
+    op_next = 8
+    op_jump = 9
+    op_frame = 10
+    op_transition = 11
+
+    def __init__(self):
+        self.code = bytearray()
+        self._repeat = False
+
+    def _emit(self, *values):
+        self.code += bytearray(values)
+        if len(self.code) > self.size:
+            raise RuntimeError("Playlist: longer than %d bytes" % self.size)
+
+    def label(self):
+        # The address of the next instruction, for jump().
+        return len(self.code)
+
+    def clear(self):
+        self._emit(self.op_clear)
+
+    def text(self, x, y, message, font=0):
+        # 'message' is Latin-1, as for Readerboard.draw_text.
+        message = bytearray(message)
+        if len(message) > 255:
+            raise RuntimeError("Playlist.text: message too long")
+        self._emit(self.op_text, x, y | (font << 4), len(message), *message)
+
+    def show(self):
+        self._emit(self.op_show)
+
+    def message(self, x=0, y=0, message=None, font=0):
+        self.clear()
+        if message:
+            self.text(x, y, message, font)
+        self.show()
+
+    def frame(self, data_r):
+        # A whole frame (105 bytes, as for set_frame), compressed, into the
+        # hidden buffer: for a logo or anything the fonts cannot draw.
+        self._emit(self.op_frame, *Readerboard.encode_rle(data_r))
+
+    def transition(self, kind, frames_per_step, step):
+        # Shows the hidden buffer with Readerboard.transition_* 'kind', and
+        # waits for it. 'step' is limited as for Readerboard.transition.
+        self._emit(self.op_transition, kind, frames_per_step, step)
+
+    def wait(self, frames):
+        while frames > 0:
+            n = min(frames, 255)
+            self._emit(self.op_wait, n)
+            frames -= n
+
+    def scroll_left(self, frames_per_pixel, pixel_count):
+        self._emit(self.op_scroll_left, frames_per_pixel, pixel_count)
+
+    def scroll_right(self, frames_per_pixel, pixel_count):
+        self._emit(self.op_scroll_right, frames_per_pixel, pixel_count)
+
+    def repeat(self, count):
+        # Runs everything up to next() 'count' times. Does not nest.
+        if self._repeat:
+            raise RuntimeError("Playlist.repeat: repeats do not nest")
+        self._repeat = True
+        self._emit(self.op_repeat, count)
+
+    def next(self):
+        if not self._repeat:
+            raise RuntimeError("Playlist.next: no repeat")
+        self._repeat = False
+        self._emit(self.op_next)
+
+    def jump(self, address):
+        self._emit(self.op_jump, address)
+
+    def end(self):
+        self._emit(self.op_end)
 
 class Readerboard(object):
     led_req_type = (0 << 7) | (2 << 5) | (0 << 0)
+    bulk_out_endpoint = 0x01
+    event_in_endpoint = 0x82
+    event_frame_sync = 0x01
+    event_animation_done = 0x02
+    display_mono = 0
+    display_gray = 1
+    display_bicolor = 2
+    display_canvas = 3
+    display_layered = 4
+    canvas = 2
+    red = 1
+    green = 2
+    yellow = 3
+    op_copy = 0
+    op_or = 1
+    op_and = 2
+    op_xor = 3
+    op_clear = 4
+    sprite_count = 4
+    font_ascii = 0
+    font_caps = 1
+    font_user = 2
+    user_font_glyphs = 36
+    transition_wipe_right = 0
+    transition_wipe_left = 1
+    transition_dissolve = 2
+    transition_slide_left = 3
+    transition_slide_right = 4
+    transition_blind = 5
+    sprite_pool_size = 32
+    frame_size = 7 * 15
+    batch_max = 4096
     
     def __init__(self):
         self.device = usb.core.find(idVendor=0x8080, idProduct=0x6464)
@@ -34,38 +158,375 @@ class Readerboard(object):
         self.cfg = self.device.get_active_configuration()
         self.intf = self.cfg[(0, 0)]
         self.back_buffer = 0
+        self._batch = None
+        self._batch_wait = False
+
+    def _vendor_out(self, request, value, data=None, wait=False):
+        # Commands are queued on the device and run between frames. With
+        # 'wait', the transfer completes only once the command has run, and
+        # fails if the command failed.
+        if self._batch is None:
+            self.device.ctrl_transfer(self.led_req_type, request, value, int(wait), data)
+        else:
+            data = bytearray() if data is None else bytearray(data)
+            if len(data) > 255:
+                raise RuntimeError("batch: command data longer than 255 bytes")
+            header = struct.pack("BBBB", request, value & 0xFF, value >> 8, len(data))
+            self._batch.append(bytearray(header) + data)
+            self._batch_wait = self._batch_wait or wait
 
-    def set_line(self, row, data_r, data_g, buffer_n=None):
+    @contextlib.contextmanager
+    def batch(self):
+        # Commands issued inside the block are sent as one control transfer
+        # (or a few, if very long) when the block exits.
+        if self._batch is not None:
+            raise RuntimeError("batch: batches do not nest")
+        self._batch = []
+        self._batch_wait = False
+        try:
+            yield self
+        except:
+            self._batch = None
+            raise
+        commands, self._batch = self._batch, None
+        data = bytearray()
+        for command in commands:
+            if len(data) + len(command) > self.batch_max:
+                self.device.ctrl_transfer(self.led_req_type, 10, 0, int(self._batch_wait), data)
+                data = bytearray()
+            data += command
+        if data:
+            self.device.ctrl_transfer(self.led_req_type, 10, 0, int(self._batch_wait), data)
+
+    def set_line(self, row, data_r, data_g=None, buffer_n=None):
+        # data_g is plane 1, which is buffer 1; only meaningful with
+        # buffer_n 0 in display_bicolor mode.
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
         if buffer_n not in (0, 1):
             raise RuntimeError("set_line: invalid buffer_n value: " + buffer_n)
         data = struct.pack("BB", 0, row) + data_r
-        self.device.ctrl_transfer(self.led_req_type, buffer_n, 0, 0, data)
-        #self.device.ctrl_transfer(self.led_req_type, buffer_n, 0x100 | row, 0, data_g)
+        self._vendor_out(buffer_n, 0, data)
+        if data_g is not None:
+            data = struct.pack("BB", 1, row) + data_g
+            self._vendor_out(buffer_n, 0, data)
+
+    def set_display_mode(self, mode, layer_op=op_or):
+        # Takes effect at the next frame boundary. In display_gray mode,
+        # buffer 0 is the weight 1 plane and buffer 1 the weight 2 plane of
+        # the displayed frame; in display_bicolor mode they are red and
+        # green. In both, show_buffer has no effect. In display_canvas mode
+        # the two buffers are one 240-pixel row; draw_text with
+        # buffer_n=canvas draws across it. In display_layered mode buffer 1
+        # is drawn over buffer 0 with 'layer_op' (op_or, op_xor, ...); the
+        # viewport, scrolls and row map move buffer 1 only. display_bicolor
+        # needs firmware built with BICOLOR=yes; other builds stall it.
+        self._vendor_out(12, (layer_op << 8) | mode)
 
-    def show_buffer(self, buffer_n=None):
+    def set_frame_rate(self, hz):
+        # 35 to 250 frames per second; rows are scanned at 7 times this.
+        self._vendor_out(13, hz)
+
+    def set_brightness(self, level):
+        # 0 (off) to 255 (full); no need to re-upload the frame.
+        self._vendor_out(14, level)
+
+    def set_gray_line(self, row, levels):
+        # One row of 120 pixel levels, 0 (off) to 3 (full).
+        if len(levels) != 120:
+            raise RuntimeError("set_gray_line: row must be 120 pixels")
+        planes = (bytearray(15), bytearray(15))
+        for x, level in enumerate(levels):
+            for plane in (0, 1):
+                if level & (1 << plane):
+                    planes[plane][x >> 3] |= 0x80 >> (x & 7)
+        for plane in (0, 1):
+            data = struct.pack("BB", plane, row) + bytes(planes[plane])
+            self._vendor_out(0, 0, data)
+
+    def show_buffer(self, buffer_n=None, wait=False):
+        # The device swaps buffers at the next frame boundary. With 'wait',
+        # the request does not complete until the swap has happened.
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
-        self.device.ctrl_transfer(self.led_req_type, 2, buffer_n, 0)
+        self._vendor_out(2, buffer_n, wait=wait)
         self.back_buffer = 1 - buffer_n
 
     def clear_buffer(self, buffer_n=None):
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
-        self.device.ctrl_transfer(self.led_req_type, 3, buffer_n, 0)
+        self._vendor_out(3, buffer_n)
     
-    def draw_text(self, x, y, message, buffer_n=None):
+    def set_frame(self, data_r, buffer_n=None):
+        # All seven rows in one control transfer.
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        if len(data_r) != self.frame_size:
+            raise RuntimeError("set_frame: frame must be %d bytes" % self.frame_size)
+        self._vendor_out(8, buffer_n, data_r)
+
+    @staticmethod
+    def _rle_run(source, base, i):
+        # Longest zero, one or unchanged run starting at source[i].
+        best_op, best_n = None, 0
+        for op in (0x40, 0x80, 0xC0):
+            n = 0
+            while (i + n < len(source)) and (n < 64):
+                value = source[i + n]
+                if op == 0x40 and value != 0x00:
+                    break
+                if op == 0x80 and value != 0xFF:
+                    break
+                if op == 0xC0 and (base is None or value != base[i + n]):
+                    break
+                n += 1
+            if n > best_n:
+                best_op, best_n = op, n
+        return best_op, best_n
+
+    @staticmethod
+    def encode_rle(data_r, previous=None):
+        # Rows equal to the same row of 'previous' are left out of the row
+        # mask; within sent rows, bytes equal to 'previous' may be skipped.
+        data_r = bytearray(data_r)
+        previous = None if previous is None else bytearray(previous)
+        row_mask = 0
+        source = bytearray()
+        base = None if previous is None else bytearray()
+        for row in range(7):
+            line = data_r[row * 15:(row + 1) * 15]
+            if previous is not None:
+                old_line = previous[row * 15:(row + 1) * 15]
+                if line == old_line:
+                    continue
+                base += old_line
+            row_mask |= 1 << row
+            source += line
+
+        encoded = bytearray([row_mask])
+        i = 0
+        while i < len(source):
+            op, n = Readerboard._rle_run(source, base, i)
+            if n >= 2:
+                encoded.append(op | (n - 1))
+                i += n
+                continue
+            j = i + 1
+            while (j < len(source)) and (j - i < 64):
+                if Readerboard._rle_run(source, base, j)[1] >= 2:
+                    break
+                j += 1
+            encoded.append(0x00 | (j - i - 1))
+            encoded += source[i:j]
+            i = j
+        return encoded
+
+    def set_frame_rle(self, data_r, previous=None, buffer_n=None):
+        # 'previous' must be what the device buffer holds now, or None.
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        if len(data_r) != self.frame_size:
+            raise RuntimeError("set_frame_rle: frame must be %d bytes" % self.frame_size)
+        data = self.encode_rle(data_r, previous)
+        if len(data) >= self.frame_size:
+            self.set_frame(data_r, buffer_n)
+        else:
+            self._vendor_out(9, buffer_n, data)
+
+    def draw_text(self, x, y, message, buffer_n=None, color=None, font=font_ascii):
+        # With a color (red, green or yellow) the text is drawn into both
+        # planes of a display_bicolor frame, and buffer_n must be 0.
+        # 'message' is Latin-1; characters a font lacks fall back to the
+        # nearest ASCII one.
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        if color is not None:
+            if buffer_n != 0:
+                raise RuntimeError("draw_text: color requires buffer_n 0")
+            buffer_n |= color << 8
+        buffer_n |= font << 12
         data = struct.pack("BB", x, y) + message
-        self.device.ctrl_transfer(self.led_req_type, 4, buffer_n, 0, data)
+        self._vendor_out(4, buffer_n, data)
+
+    def load_font(self, first, glyphs):
+        # Replaces font_user, stored in EEPROM. 'glyphs' are for consecutive
+        # characters from 'first': (width, advance, rows), up to 8 pixels
+        # wide and 7 rows, MSB first. Slow: the device writes ~300 bytes/s.
+        if len(glyphs) > self.user_font_glyphs:
+            raise RuntimeError("load_font: at most %d glyphs" % self.user_font_glyphs)
+        data = bytearray()
+        for width, advance, rows in glyphs:
+            if width > 8 or advance > 15 or len(rows) > 7:
+                raise RuntimeError("load_font: glyph too large")
+            data.append((advance << 4) | width)
+            data += bytearray(rows) + bytearray(7 - len(rows))
+        self._vendor_out(17, first, data)
         
-    def scroll_left(self, frames_per_pixel, pixel_count, buffer_n=None):
+    def load_sprite(self, sprite_n, width, height, data):
+        # Rows of (width + 7) // 8 bytes, MSB first. Sprites share a 32-byte
+        # pool and are packed in order: loading sprite n discards sprites
+        # above it, so load 0 first.
+        if len(data) != ((width + 7) // 8) * height:
+            raise RuntimeError("load_sprite: data does not match width and height")
+        data = struct.pack("BB", width, height) + data
+        self._vendor_out(15, sprite_n, data)
+
+    def draw_sprite(self, sprite_n, x, y, op=op_copy, buffer_n=None):
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        data = struct.pack("BBBB", sprite_n, op, x, y)
+        self._vendor_out(16, buffer_n, data)
+
+    def set_viewport(self, x):
+        # Buffer column 0-119 (0-239 in display_canvas mode) shown at the
+        # left edge of the sign; columns wrap around. Takes effect at the
+        # next frame boundary. Whole-sign scroll_left and scroll_right move
+        # it one column per pixel and leave it where they end; a counted
+        # scroll outside display_canvas mode blanks each column it brings
+        # in. Window scrolls leave it alone.
+        self._vendor_out(18, x)
+
+    def _scroll_data(self, frames, count, columns, rows):
+        # An optional window: columns (x1, x2) and rows (y1, y2), the
+        # second of each exclusive. Only the window moves. In display_mono
+        # mode a window scroll draws each step in the back buffer and
+        # flips, so leave both buffers alone until it is done.
+        data = struct.pack("BB", frames, count)
+        if columns is not None or rows is not None:
+            data += struct.pack("BB", *(columns or (0, 120)))
+        if rows is not None:
+            data += struct.pack("BB", *rows)
+        return data
+
+    def scroll_left(self, frames_per_pixel, pixel_count, buffer_n=None, loop=False,
+                    columns=None, rows=None):
+        # With 'loop' the scroll runs until stop_animation; pixel_count is
+        # ignored. A looping window rotates its content.
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        data = self._scroll_data(frames_per_pixel, pixel_count, columns, rows)
+        self._vendor_out(5, (int(loop) << 8) | buffer_n, data)
+
+    def scroll_right(self, frames_per_pixel, pixel_count, buffer_n=None, loop=False,
+                     columns=None, rows=None):
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
-        data = struct.pack("BB", frames_per_pixel, pixel_count)
-        self.device.ctrl_transfer(self.led_req_type, 5, buffer_n, 0, data)
+        data = self._scroll_data(frames_per_pixel, pixel_count, columns, rows)
+        self._vendor_out(6, (int(loop) << 8) | buffer_n, data)
+
+    def stop_animation(self):
+        self._vendor_out(22, 0)
+
+    def marquee(self, message, frames_per_pixel=1, font=font_ascii):
+        # Loops 'message' (up to 240 pixels) around the canvas until
+        # stop_animation; the host has nothing more to send.
+        with self.batch():
+            self.stop_animation()
+            self.clear_buffer(0)
+            self.clear_buffer(1)
+            self.draw_text(0, 0, message, buffer_n=self.canvas, font=font)
+            self.set_display_mode(self.display_canvas)
+            self.set_viewport(0)
+            self.scroll_left(frames_per_pixel, 0, buffer_n=0, loop=True)
 
-    def scroll_right(self, frames_per_pixel, pixel_count, buffer_n=None):
+    def scroll_up(self, frames_per_row, row_count, roll=False, buffer_n=None, rows=None):
+        # With 'roll', the back buffer rolls in from the bottom and is shown
+        # once it has (row_count is then 7 regardless). Otherwise 'rows'
+        # (y1, y2) may limit the scroll to those rows. Fails if an animation
+        # is running (stop_animation first). Waits for the device to
+        # accept it, so a failure raises before the back buffer flips.
         buffer_n = self.back_buffer if buffer_n is None else buffer_n
-        data = struct.pack("BB", frames_per_pixel, pixel_count)
-        self.device.ctrl_transfer(self.led_req_type, 6, buffer_n, 0, data)
+        data = self._scroll_data(frames_per_row, row_count, None, rows)
+        self._vendor_out(19, (int(roll) << 8) | buffer_n, data, wait=True)
+        if roll:
+            self.back_buffer = 1 - self.back_buffer
+
+    def scroll_down(self, frames_per_row, row_count, roll=False, buffer_n=None, rows=None):
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        data = self._scroll_data(frames_per_row, row_count, None, rows)
+        self._vendor_out(20, (int(roll) << 8) | buffer_n, data, wait=True)
+        if roll:
+            self.back_buffer = 1 - self.back_buffer
+
+    def transition(self, kind, frames_per_step=0, step=1):
+        # Shows the back buffer with a transition_* effect, like show_buffer:
+        # 'step' is columns (wipe, slide), pixels (dissolve; 840 in all) or
+        # rows (blind) per step. The sign holds a wipe to 12 columns and a
+        # dissolve to 64 pixels a step, so a step fits between two rows of
+        # the refresh. In display_mono mode only; fails if an animation is
+        # running (stop_animation first). Waits for the device to accept
+        # it, so a failure raises before the back buffer flips.
+        self._vendor_out(26, kind, struct.pack("BB", frames_per_step, step), wait=True)
+        self.back_buffer = 1 - self.back_buffer
+
+    def load_playlist(self, playlist):
+        # Stored in EEPROM, so it survives a reset. Slow, like load_font.
+        self._vendor_out(23, 0, playlist.code)
+
+    def play_playlist(self):
+        # Fails if an animation is running; stop_animation first. Waits for
+        # the device to accept it, so a failure raises here.
+        self._vendor_out(24, 0, wait=True)
+
+    def set_boot_playlist(self, enabled=True):
+        # Runs the stored playlist at power-on, before (or without) any
+        # host, so the sign lights up within a frame of reset.
+        self._vendor_out(25, int(enabled))
+
+    def set_row_map(self, rows):
+        # Seven entries: sign row n shows row rows[n] of the displayed
+        # buffer, or of the other buffer if 8 is added.
+        if len(rows) != 7:
+            raise RuntimeError("set_row_map: 7 rows")
+        self._vendor_out(21, 0, bytearray(rows))
+
+    def bulk_target(self, buffer_n=None, flip=False):
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        # Wait, so bulk data sent next cannot overtake the queued request.
+        self._vendor_out(7, (int(flip) << 8) | buffer_n, wait=True)
+
+    def write_frame(self, data_r, buffer_n=None):
+        # One 105-byte frame (7 rows of 15 bytes) over the bulk endpoint.
+        if self._batch is not None:
+            raise RuntimeError("write_frame: bulk transfers cannot be batched")
+        if len(data_r) != self.frame_size:
+            raise RuntimeError("write_frame: frame must be %d bytes" % self.frame_size)
+        self.bulk_target(buffer_n)
+        self.device.write(self.bulk_out_endpoint, data_r)
+
+    def stream_frames(self, frames, buffer_n=None):
+        # The device shows each frame as soon as it is complete, then
+        # switches to the other buffer for the next one.
+        if self._batch is not None:
+            raise RuntimeError("stream_frames: bulk transfers cannot be batched")
+        buffer_n = self.back_buffer if buffer_n is None else buffer_n
+        self.bulk_target(buffer_n, flip=True)
+        for data_r in frames:
+            if len(data_r) != self.frame_size:
+                raise RuntimeError("stream_frames: frame must be %d bytes" % self.frame_size)
+            self.device.write(self.bulk_out_endpoint, data_r)
+            buffer_n = 1 - buffer_n
+            self.back_buffer = buffer_n
+
+    def _wait_report(self, events, timeout):
+        # Arms the device to report the next frame on which any of 'events'
+        # happens, and blocks until it does. Returns the report as
+        # (events, buffer_n, frame_count, stack_unused).
+        if self._batch is not None:
+            raise RuntimeError("wait_event: cannot wait inside a batch")
+        # Wait, so the endpoint has been reset (and any stale report
+        # dropped) before reading.
+        self._vendor_out(11, events, wait=True)
+        data = self.device.read(self.event_in_endpoint, 8, timeout=timeout)
+        return struct.unpack("<BBHB", bytearray(data)[:5])
+
+    def wait_event(self, events, timeout=10000):
+        # Returns (events, frame_count) of the next frame on which any of
+        # 'events' happens.
+        events, buffer_n, frame_count, stack_unused = self._wait_report(events, timeout)
+        return events, frame_count
+
+    def stack_unused(self, timeout=1000):
+        # Bytes of SRAM the firmware's stack has never reached since reset,
+        # from its stack paint.
+        return self._wait_report(self.event_frame_sync, timeout)[3]
+
+    def wait_vsync(self, timeout=1000):
+        return self.wait_event(self.event_frame_sync, timeout)[1]
+
+    def wait_animation(self, timeout=10000):
+        return self.wait_event(self.event_animation_done, timeout)[1]
 
 def read_leaderboard():
     f = csv.reader(open('/home/mutant/mcor/leaderboard/data/leaderboard.txt', 'r'))
@@ -78,58 +539,109 @@ def read_leaderboard():
         result.append(d)
     return tuple(sorted(result, lambda x, y: cmp(y['score'], x['score'])))
 
+def show_message(board, x=0, y=0, message=None):
+    with board.batch():
+        board.clear_buffer()
+        if message:
+            board.draw_text(x, y, message)
+        board.show_buffer()
+
 def message_sequence(board, score_data):
-    board.clear_buffer()
-    board.draw_text(9, 0, "CHURCH OF ROBOTRON")
-    board.show_buffer()
+    show_message(board, 9, 0, "CHURCH OF ROBOTRON")
     time.sleep(1.0)
     board.scroll_left(0, 120)
-    time.sleep(3.0)
+    board.wait_animation()
     
-    board.clear_buffer()
-    board.draw_text(32, 0, "INSERT COIN")
-    board.show_buffer()
+    show_message(board, 32, 0, "INSERT COIN")
     time.sleep(2.0)
 
     for i in range(5):
-        board.clear_buffer()
-        board.draw_text(0, 0, "PREPARE FOR JUDGEMENT")
-        board.show_buffer()
+        show_message(board, 0, 0, "PREPARE FOR JUDGEMENT")
         time.sleep(0.3)
-        board.clear_buffer()
-        board.show_buffer()
+        show_message(board)
         time.sleep(0.3)
 
-    board.clear_buffer()
-    board.show_buffer()
+    show_message(board)
     time.sleep(1.0)
 
     if score_data:    
-        board.clear_buffer()
-        board.draw_text(24, 0, "MUTANT SAVIOR")
-        board.show_buffer()
+        show_message(board, 24, 0, "MUTANT SAVIOR")
         time.sleep(2.0)
     
-        board.clear_buffer()
-        board.draw_text(24, 0, "TOP CANDIDATE")
-        board.show_buffer()
+        show_message(board, 24, 0, "TOP CANDIDATE")
         time.sleep(2.0)
     
-        board.clear_buffer()
         d = score_data[0]
-        board.draw_text(32, 0, "%(score)s %(initials)s" % d)
-        board.show_buffer()
+        show_message(board, 32, 0, "%(score)s %(initials)s" % d)
         time.sleep(2.0)
         board.scroll_right(0, 120)
-        time.sleep(3.0)
+        board.wait_animation()
+
+def attract_playlist(score_data, frame_rate=60):
+    # message_sequence, run by the device.
+    def seconds(t):
+        return int(t * frame_rate)
+
+    p = Playlist()
+    start = p.label()
+    p.message(9, 0, "CHURCH OF ROBOTRON")
+    p.wait(seconds(1.0))
+    p.scroll_left(0, 120)
+
+    p.message(32, 0, "INSERT COIN")
+    p.wait(seconds(2.0))
+
+    p.repeat(5)
+    p.message(0, 0, "PREPARE FOR JUDGEMENT")
+    p.wait(seconds(0.3))
+    p.message()
+    p.wait(seconds(0.3))
+    p.next()
+
+    p.message()
+    p.wait(seconds(1.0))
+
+    if score_data:
+        p.message(24, 0, "MUTANT SAVIOR")
+        p.wait(seconds(2.0))
+
+        p.message(24, 0, "TOP CANDIDATE")
+        p.wait(seconds(2.0))
+
+        d = score_data[0]
+        p.message(32, 0, "%(score)s %(initials)s" % d)
+        p.wait(seconds(2.0))
+        p.scroll_right(0, 120)
+    p.jump(start)
+    return p
 
 score_data = None
+#score_data = read_leaderboard()
+playlist = attract_playlist(score_data)
+
+# The playlist and the boot setting are kept in EEPROM, which is slow to
+# write and wears, so the playlist is only loaded when it differs from the
+# one last loaded, and the boot setting is made once. A reconnect (after
+# the sign resets, say) finds both still there.
+loaded_code = None
+boot_set = False
 
 while True:
     try:
         board = Readerboard()
-        #score_data = read_leaderboard()
-        message_sequence(board, score_data)
+        board.stop_animation()
+        board.set_display_mode(board.display_mono)
+        if loaded_code != playlist.code:
+            board.load_playlist(playlist)
+            loaded_code = bytearray(playlist.code)
+        if not boot_set:
+            board.set_boot_playlist()
+            boot_set = True
+        board.play_playlist()
+        while True:
+            # Raises once the board goes away.
+            board.wait_vsync()
+            time.sleep(5.0)
     except Exception, e:
         print(e)
         time.sleep(5.0)